@@ -27,98 +27,367 @@
 #include "datacarddevice.h"
 #include <stdlib.h>
 #include <poll.h>
+#include <sys/epoll.h>
 #include <stdio.h>
 #include <string.h>
 
 
 int CardDevice::handle_rd_data()
 {
-    char c;
-    int ret;
+    ssize_t ret;
 
-    while ((ret = read(m_data_fd, &c, 1)) == 1) 
+    // Pull in everything the tty has for us in a single call
+    do
     {
-        if (m_rd_buff_pos >= RDBUFF_MAX || m_rd_buff_pos < 0)
-	{
-	    Debug(DebugAll,"Device %s: Buffer exceeded - cleared", c_str());
-	    m_rd_buff_pos = 0;
-	    memset(m_rd_buff, 0, RDBUFF_MAX);
+	ret = read(m_data_fd, m_rd_buff + m_rd_buff_pos, RDBUFF_MAX - 1 - m_rd_buff_pos);
+    } while (ret < 0 && errno == EINTR);
+
+    // Reactor ttys are non blocking, nothing to read after all
+    if (ret < 0 && errno == EAGAIN)
+	return 0;
+    if (ret < 0)
+    {
+	Debug(DebugAll, "[%s] read() error: %d", c_str(), errno);
+	return -1;
+    }
+    m_rd_reads++;
+
+    char* end = m_rd_buff + m_rd_buff_pos + ret;
+    char* line = m_rd_buff;
+
+    // Split complete lines in place, empty lines are CR/LF runs
+    for (char* p = m_rd_buff + m_rd_buff_pos; p < end; p++)
+    {
+	if (*p != '\r' && *p != '\n')
 	    continue;
-	    //return -1;
-	}
-	
-	switch (m_state) 
+	*p = '\0';
+	if (p > line)
 	{
-	    case BLT_STATE_WANT_CONTROL:
-		if (c != '\r' && c != '\n')
-		{
-		    m_state = BLT_STATE_WANT_CMD;
-		    m_rd_buff[m_rd_buff_pos++] = c;
-		} 
-		else
-		    return 0;
-		break;
-	    case BLT_STATE_WANT_CMD:
-		if (c == '\r' || c == '\n')
-		{
-		    m_state = BLT_STATE_WANT_CONTROL;
-		    Debug(DebugAll,"[%s] : [%s]\n",c_str(), m_rd_buff);
-
-		    int res = at_response(m_rd_buff,at_read_result_classification(m_rd_buff));
-    
-		    m_rd_buff_pos = 0;
-		    memset(m_rd_buff, 0, RDBUFF_MAX);
-		    return res;
-		}
-		else 
-		{
-		    m_rd_buff[m_rd_buff_pos++] = c;
-		}
-		break;
-    	    default:
-        	Debug(DebugAll,"Device %s: Unknown device state %d\n", c_str(), m_state);
-        	return -1;
+	    m_rd_lines++;
+	    Debug(DebugAll,"[%s] : [%s]\n",c_str(), line);
+	    int res = at_response(line, at_read_result_classification(line));
+	    if (res)
+	    {
+		m_rd_buff_pos = 0;
+		return res;
+	    }
 	}
+	line = p + 1;
+    }
+
+    // Keep the unterminated tail for the next read
+    m_rd_buff_pos = end - line;
+    if (m_rd_buff_pos && line != m_rd_buff)
+	memmove(m_rd_buff, line, m_rd_buff_pos);
+    m_rd_buff[m_rd_buff_pos] = '\0';
+
+    // SMS prompt is the only response not followed by a line terminator
+    if (m_rd_buff_pos == 2 && m_rd_buff[0] == '>' && m_rd_buff[1] == ' ')
+    {
+	m_rd_lines++;
+	m_rd_buff_pos = 0;
+	return at_response(m_rd_buff, RES_SMS_PROMPT);
+    }
+
+    if (m_rd_buff_pos >= RDBUFF_MAX - 1)
+    {
+	Debug(DebugAll,"Device %s: Buffer exceeded - cleared", c_str());
+	m_rd_buff_pos = 0;
     }
-    return ret;
+    return 0;
 }
 
-void CardDevice::processATEvents()
+void CardDevice::atStart()
 {
-    struct pollfd fds;
-
-    m_mutex.lock();
+    Lock lock(m_mutex);
 
     //This may be unnecessary
     m_commandQueue.clear();
-    m_lastcmd = 0;
+    m_pipelined.clear();
+    TelEngine::destruct(m_lastcmd);
     //--
+    m_rd_buff_pos = 0;
+    m_wr_buff_len = 0;
+    m_at_activity = Time::msecNow();
     m_commandQueue.append(new ATCommand("AT", CMD_AT));
+}
 
-    m_mutex.unlock();
+bool CardDevice::atCheckLink()
+{
+    if (dataStatus() || audioStatus())
+    {
+	Debug(DebugAll, "Lost connection to Datacard %s", c_str());
+	disconnect();
+	return false;
+    }
+    return true;
+}
+
+bool CardDevice::atWantWrite()
+{
+    // Output the tty did not take goes first
+    if (m_wr_buff_len)
+	return true;
+    ATCommand* cmd = static_cast<ATCommand*>(m_commandQueue.get());
+    if (!cmd)
+	return false;
+    if (!m_lastcmd)
+	return true;
+    // Responses come back in order, so only batch commands we can match
+    // without looking at their content and never stack behind other ones
+    if (!(m_pipeline && cmd->m_pipeline && m_lastcmd->m_pipeline))
+	return false;
+    return m_pipelined.count() + 1 < DC_PIPELINE_MAX;
+}
+
+// Default response timeout and retry budget of each command type
+static void atPolicy(ATCommand* cmd)
+{
+    unsigned int timeout = DC_CMD_TIMEOUT;
+    unsigned int retries = DC_CMD_RETRIES;
+    switch (cmd->m_cmd)
+    {
+	// Resending would place a second call or send a second message
+	case CMD_AT_A:
+	case CMD_AT_D:
+	case CMD_AT_CLIR:
+	    timeout = 10000;
+	    retries = 0;
+	    break;
+	case CMD_AT_CMGS:
+	    timeout = 30000;
+	    retries = 0;
+	    break;
+	// A resent list would deliver the messages listed so far again
+	case CMD_AT_CMGL:
+	    timeout = 30000;
+	    retries = 0;
+	    break;
+	case CMD_AT_CUSD:
+	    timeout = 10000;
+	    retries = 0;
+	    break;
+	case CMD_AT_DTMF:
+	    retries = 0;
+	    break;
+	// Network dependent
+	case CMD_AT_COPS:
+	case CMD_AT_COPS_INIT:
+	case CMD_AT_CREG:
+	    timeout = 10000;
+	    break;
+	case CMD_AT_Z:
+	    timeout = 5000;
+	    break;
+	default:
+	    break;
+    }
+    cmd->policy(timeout, retries);
+}
+
+void CardDevice::atWrite()
+{
+    if(m_wr_buff_len)
+    {
+	if(atFlush())
+	    disconnect();
+	return;
+    }
+    if(!atWantWrite())
+	return;
+
+    ATCommand* cmd = static_cast<ATCommand*>(m_commandQueue.get());
+    if(cmd)
+    {
+	if(at_write_full((char*)cmd->m_command.safe(),cmd->m_command.length()))
+	{
+	    disconnect();
+	    return;
+	}
+	m_commandQueue.remove(cmd);
+	if (m_lastcmd)
+	{
+	    m_pipelined.append(cmd);
+	    m_at_pipelined++;
+	}
+	else
+	{
+	    m_lastcmd = cmd;
+	    atArm();
+	}
+	m_at_activity = Time::msecNow();
+    }
+}
+
+void CardDevice::atCommandDone()
+{
+    if (m_lastcmd)
+	m_lastcmd->destruct();
+    m_lastcmd = static_cast<ATCommand*>(m_pipelined.get());
+    if (m_lastcmd)
+    {
+	m_pipelined.remove(m_lastcmd, false);
+	atArm();
+    }
+}
+
+void CardDevice::atArm()
+{
+    // The modem answers in order, the clock runs from when a command is in front
+    m_lastcmd->m_deadline = Time::msecNow() + m_lastcmd->m_timeout;
+    if (m_reactor)
+	m_reactor->schedule(this, m_lastcmd->m_deadline);
+}
+
+bool CardDevice::atExpire(u_int64_t now)
+{
+    Lock lock(m_mutex);
+    if (!m_connected)
+	return false;
+    if (!m_lastcmd || !m_lastcmd->m_deadline || now < m_lastcmd->m_deadline)
+	return true;
+    return atTimeout();
+}
+
+bool CardDevice::atTimeout()
+{
+    ATCommand* cmd = m_lastcmd;
+    m_at_timeouts++;
+    Debug(DebugAll, "[%s] timeout while waiting '%s' in response to '%s'", c_str(), at_res2str(cmd->m_res), at_cmd2str(cmd->m_cmd));
+    cmd->onTimeout();
+
+    // A modem stuck at the SMS prompt ignores commands until ESC
+    if (cmd->m_cmd == CMD_AT_CMGS && atOutput("\x1b", 1))
+	Debug(DebugAll, "[%s] could not send ESC to leave the SMS prompt", c_str());
+
+    if (cmd->m_retries)
+    {
+	// Resend the whole pipeline in order, later responses can't be matched
+	cmd->m_retries--;
+	m_at_retries++;
+	ATCommand* resend[DC_PIPELINE_MAX];
+	unsigned int n = 0;
+	resend[n++] = cmd;
+	while (ATCommand* next = static_cast<ATCommand*>(m_pipelined.get()))
+	{
+	    m_pipelined.remove(next, false);
+	    if (n < DC_PIPELINE_MAX)
+		resend[n++] = next;
+	    else
+		next->destruct();
+	}
+	m_lastcmd = 0;
+	while (n)
+	{
+	    resend[--n]->m_deadline = 0;
+	    m_commandQueue.insert(resend[n]);
+	}
+	if (m_reactor)
+	    m_reactor->update(this);
+	return true;
+    }
+
+    // Out of retries, handle it as if the modem said ERROR
+    Debug(DebugAll, "[%s] giving up on '%s'", c_str(), at_cmd2str(cmd->m_cmd));
+    int res = at_response_error();
+    if (m_lastcmd == cmd)
+	atCommandDone();
+    if (res)
+    {
+	disconnect();
+	return false;
+    }
+    if (m_reactor)
+	m_reactor->update(this);
+    return true;
+}
+
+void CardDevice::atQueueIdentity()
+{
+    if (!m_pipeline)
+    {
+	queueCommand(new ATCommand("AT+CGMI", CMD_AT_CGMI));
+	return;
+    }
+    queueCommand((new ATCommand("AT+CGMI", CMD_AT_CGMI))->pipelined());
+    queueCommand((new ATCommand("AT+CGMM", CMD_AT_CGMM))->pipelined());
+    queueCommand((new ATCommand("AT+CGMR", CMD_AT_CGMR))->pipelined());
+    queueCommand((new ATCommand("AT+CMEE=0", CMD_AT_CMEE))->pipelined());
+    queueCommand((new ATCommand("AT+CGSN", CMD_AT_CGSN))->pipelined());
+}
+
+bool CardDevice::atRead()
+{
+    m_at_activity = Time::msecNow();
+    if (handle_rd_data())
+    {
+	disconnect();
+	return false;
+    }
+    return true;
+}
+
+bool CardDevice::atIdle()
+{
+    // Commands waiting for response are handled by their deadline
+    if (!m_initialized && !m_lastcmd)
+    {
+	Debug(DebugAll, "[%s] timeout waiting for data, disconnecting", c_str());
+	Debug(DebugAll, "Error initializing Datacard %s", c_str());
+	disconnect();
+	return false;
+    }
+    return true;
+}
+
+void CardDevice::queueCommand(ATCommand* cmd)
+{
+    Lock lock(m_mutex);
+    if (!cmd->m_timeout)
+	atPolicy(cmd);
+    m_commandQueue.append(cmd);
+    if (m_reactor)
+	m_reactor->update(this);
+}
+
+void CardDevice::processATEvents()
+{
+    struct pollfd fds;
+
+    atStart();
 
     // Main loop
     while (isRunning())
     {
         m_mutex.lock();
-        if (dataStatus() || audioStatus())
+        if (!atCheckLink())
         {
-            Debug(DebugAll, "Lost connection to Datacard %s", c_str());
-            disconnect();
             m_mutex.unlock();
             return;
         }
-        m_mutex.unlock();
 
 	fds.fd = m_data_fd;
 	fds.events = POLLIN;
 	fds.revents = 0;
 
-	if((m_commandQueue.count() > 0) && !m_lastcmd)
+	if(atWantWrite())
 	    fds.events |= POLLOUT;
 
+	// Wake up for the deadline of the pending command
+	int timeout = 1000;
+	if (m_lastcmd && m_lastcmd->m_deadline)
+	{
+	    u_int64_t now = Time::msecNow();
+	    if (m_lastcmd->m_deadline <= now)
+		timeout = 0;
+	    else if (m_lastcmd->m_deadline - now < (u_int64_t)timeout)
+		timeout = (int)(m_lastcmd->m_deadline - now);
+	}
+        m_mutex.unlock();
 
-	int res = poll(&fds, 1, 1000);
+	int res = poll(&fds, 1, timeout);
+	if (!atExpire(Time::msecNow()))
+	    return;
 	if (res < 0) {
 	    if (errno == EINTR)
 		continue;
@@ -130,57 +399,25 @@ void CardDevice::processATEvents()
 	else if(res == 0)
 	{
 	    m_mutex.lock();
-	    if (!m_initialized)
-	    {
-		Debug(DebugAll, "[%s] timeout waiting for data, disconnecting", c_str());
-		if (m_lastcmd)
-		    Debug(DebugAll, "[%s] timeout while waiting '%s' in response to '%s'", c_str(), at_res2str(m_lastcmd->m_res), at_cmd2str(m_lastcmd->m_cmd));
-
-		Debug(DebugAll, "Error initializing Datacard %s", c_str());
-		disconnect();
-		m_mutex.unlock();
+	    bool ok = atIdle();
+	    m_mutex.unlock();
+	    if (!ok)
 		return;
-	    }
-	    else
-	    {
-// TODO:
-		if (m_lastcmd)
-		{
-		    Debug(DebugAll, "[%s] timeout while waiting '%s' in response to '%s'", c_str(), at_res2str(m_lastcmd->m_res), at_cmd2str(m_lastcmd->m_cmd));
-		    m_lastcmd->onTimeout();
-//                    disconnect();
-                }
-		m_mutex.unlock();
-		continue;
-	    }
+	    continue;
 	}
 	if((fds.revents & POLLIN))
 	{
 	    //incoming data
 	    m_mutex.lock();
-	    if (handle_rd_data())
-	    {
-		disconnect();
-		m_mutex.unlock();
-		return;
-	    }
+	    bool ok = atRead();
 	    m_mutex.unlock();
+	    if (!ok)
+		return;
 	}
 	else if (fds.revents & POLLOUT)
 	{
 	    m_mutex.lock();
-	    if(!m_lastcmd)
-	    {
-
-		ATCommand* cmd = static_cast<ATCommand*>(m_commandQueue.get());
-
-		if(cmd)
-		{
-		    at_write_full((char*)cmd->m_command.safe(),cmd->m_command.length());
-		    m_commandQueue.remove(cmd, false);
-		    m_lastcmd = cmd;
-		}
-	    }
+	    atWrite();
 	    m_mutex.unlock();
 	}
 	else if (fds.revents)// & (POLLRDHUP|POLLERR|POLLHUP|POLLNVAL|POLLPRI))
@@ -194,103 +431,476 @@ void CardDevice::processATEvents()
     } // End of Main loop
 }
 
-at_res_t CardDevice::at_read_result_classification (char* command)
-{
-    if(memcmp(command,"^STIN:", 6) == 0)		// 5115
-	return RES_STIN;
-    else if(memcmp(command,"^BOOT:", 6) == 0)		// 5115
-	return RES_BOOT;
-    else if((memcmp(command,"+CNUM:", 6) == 0) || (memcmp(command,"ERROR+CNUM:", 11) == 0))
-	return RES_CNUM;
-    else if (memcmp(command,"OK", 2) == 0)		// 2637
-	return RES_OK;
-    else if (memcmp(command,"^RSSI:", 6) == 0)		// 880
-	return RES_RSSI;
-    else if (memcmp(command,"^MODE:", 6) == 0)		// 656
-	return RES_MODE;
-    else if (memcmp(command,"^CEND:", 6) == 0)		// 425
-	return RES_CEND;
-    else if (memcmp(command,"+CSSI:", 6) == 0)		// 416
-	return RES_CSSI;
-    else if (memcmp(command,"^ORIG:", 6) == 0)		// 408
-	return RES_ORIG;
-    else if (memcmp(command,"^CONF:", 6) == 0)		// 404
-	return RES_CONF;
-    else if (memcmp(command,"^CONN:", 6) == 0)		// 332
-	return RES_CONN;
-    else if (memcmp(command,"+CREG:", 6) == 0)		// 56
-	return RES_CREG;
-    else if (memcmp(command,"+COPS:", 6) == 0)		// 56
-	return RES_COPS;
-    else if (memcmp(command,"^SRVST:", 7) == 0)	// 35
-	return RES_SRVST;
-    else if (memcmp(command,"+CSQ:", 5) == 0)		// 28 init
-	return RES_CSQ;
-    else if (memcmp(command,"+CPIN:", 6) == 0)		// 28 init
-	return RES_CPIN;
-    else if (memcmp(command,"RING", 4) == 0)		// 15 incoming
-	return RES_RING;
-    else if (memcmp(command,"+CLIP:", 6) == 0)		// 15 incoming
-	return RES_CLIP;
-    else if (memcmp(command,"ERROR", 5) == 0)	// 12
-	return RES_ERROR;
-    else if (memcmp(command,"+CMTI:", 6) == 0)		// 8 SMS
-	return RES_CMTI;
-    else if (memcmp(command,"+CMGR:", 6) == 0)		// 8 SMS
-	return RES_CMGR;
-    else if (memcmp(command,"+CSSU:", 6) == 0)		// 2
-	return RES_CSSU;
-    else if (memcmp(command,"BUSY", 4) == 0)
-	return RES_BUSY;
-    else if (memcmp(command,"NO DIALTONE", 11) == 0)
-	return RES_NO_DIALTONE;
-    else if (memcmp(command,"NO CARRIER", 10) == 0)
-	return RES_NO_CARRIER;
-    else if (memcmp(command,"COMMAND NOT SUPPORT", 19) == 0)
-	return RES_ERROR;
-    else if (memcmp(command,"+CMS ERROR:", 11) == 0)
-	return RES_CMS_ERROR;
-    else if (memcmp(command,"^SMMEMFULL:", 11) == 0)
-	return RES_SMMEMFULL;
-    else if (memcmp(command,"> ", 2) == 0)
-	return RES_SMS_PROMPT;
-    else if (memcmp(command,"+CUSD:", 6) == 0)
-	return RES_CUSD;
-    else if (memcmp(command,"+CPMS:", 6) == 0)
-      return RES_CPMS;
-
-    return RES_UNKNOWN;
+void CardDevice::atEvent(unsigned int events)
+{
+    Lock lock(m_mutex);
+    if (!m_connected || !isRunning())
+	return;
+
+    if (events & EPOLLIN)
+    {
+	if (!atRead())
+	    return;
+    }
+    else if (events & EPOLLOUT)
+	atWrite();
+    else if (events)
+    {
+	disconnect();
+	return;
+    }
+    if (m_reactor)
+	m_reactor->update(this);
 }
 
+void CardDevice::atTimer(u_int64_t now)
+{
+    Lock lock(m_mutex);
+    if (!m_connected || !isRunning())
+	return;
+    if (!atCheckLink())
+	return;
+    if (now < m_at_activity + 1000)
+	return;
+    m_at_activity = now;
+    atIdle();
+}
 
-int CardDevice::at_write_full(char* buf, size_t count)
+
+//CommandQueue
+static const char* s_prioNames[PRIO_COUNT] = { "call", "dtmf", "ussd", "sms", "housekeeping" };
+
+CommandQueue::CommandQueue()
+{
+    for (int i = 0; i < PRIO_COUNT; i++)
+	m_depth[i] = m_peak[i] = 0;
+}
+
+at_prio_t CommandQueue::prio(at_cmd_t cmd)
+{
+    switch (cmd)
+    {
+	case CMD_AT_A:
+	case CMD_AT_D:
+	case CMD_AT_CLIR:
+	case CMD_AT_CHUP:
+	case CMD_AT_DDSETEX:
+	case CMD_AT_CLVL:
+	    return PRIO_CALL;
+	case CMD_AT_DTMF:
+	    return PRIO_DTMF;
+	case CMD_AT_CUSD:
+	    return PRIO_USSD;
+	case CMD_AT_CMGS:
+	case CMD_AT_CMGR:
+	case CMD_AT_CMGL:
+	case CMD_AT_CMGD:
+	    return PRIO_SMS;
+	default:
+	    return PRIO_HOUSEKEEPING;
+    }
+}
+
+void CommandQueue::append(ATCommand* cmd)
+{
+    at_prio_t p = prio(cmd->m_cmd);
+    m_queue[p].append(cmd);
+    if (++m_depth[p] > m_peak[p])
+	m_peak[p] = m_depth[p];
+}
+
+void CommandQueue::insert(ATCommand* cmd)
+{
+    at_prio_t p = prio(cmd->m_cmd);
+    m_queue[p].insert(cmd);
+    if (++m_depth[p] > m_peak[p])
+	m_peak[p] = m_depth[p];
+}
+
+ATCommand* CommandQueue::get() const
+{
+    for (int i = 0; i < PRIO_COUNT; i++)
+    {
+	if (m_depth[i])
+	    return static_cast<ATCommand*>(m_queue[i].get());
+    }
+    return 0;
+}
+
+void CommandQueue::remove(ATCommand* cmd)
+{
+    at_prio_t p = prio(cmd->m_cmd);
+    if (m_queue[p].remove(cmd, false))
+	m_depth[p]--;
+}
+
+void CommandQueue::clear()
+{
+    for (int i = 0; i < PRIO_COUNT; i++)
+    {
+	m_queue[i].clear();
+	m_depth[i] = 0;
+    }
+}
+
+unsigned int CommandQueue::count() const
+{
+    unsigned int n = 0;
+    for (int i = 0; i < PRIO_COUNT; i++)
+	n += m_depth[i];
+    return n;
+}
+
+void CommandQueue::stats(String& ret) const
+{
+    for (int i = 0; i < PRIO_COUNT; i++)
+	ret << ",q" << s_prioNames[i] << "=" << m_depth[i] << "/" << m_peak[i];
+}
+
+// Command deadline of a device kept in reactor timer wheel
+class ATTimer : public GenObject
+{
+public:
+    ATTimer(CardDevice* dev, u_int64_t when) : m_dev(dev), m_when(when) {}
+    CardDevice* m_dev;
+    u_int64_t m_when;
+};
+
+//ATReactor
+ATReactor::ATReactor(DevicesEndPoint* owner, unsigned int index)
+    : Thread("ATReactor"), m_owner(owner), m_index(index), m_epoll(-1), m_running(true), m_mutex(false),
+    m_wheelTick(Time::msecNow() / DC_REACTOR_TICK)
+{
+    m_epoll = epoll_create(64);
+    if (m_epoll < 0)
+	Debug(DebugWarn, "ATReactor %u: epoll_create() error: %d", m_index, errno);
+}
+
+ATReactor::~ATReactor()
+{
+    m_owner->reactorGone();
+    if (m_epoll >= 0)
+	close(m_epoll);
+}
+
+bool ATReactor::attach(CardDevice* dev)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = dev;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, dev->m_data_fd, &ev) < 0)
+    {
+	Debug(DebugAll, "ATReactor %u: can't watch [%s]: %d", m_index, dev->c_str(), errno);
+	return false;
+    }
+    dev->m_at_events = ev.events;
+    update(dev);
+    Lock lock(m_mutex);
+    m_devices.append(dev)->setDelete(false);
+    Debug(DebugAll, "ATReactor %u: serving [%s], %u devices", m_index, dev->c_str(), m_devices.count());
+    return true;
+}
+
+void ATReactor::detach(CardDevice* dev)
+{
+    // Must be called before the tty is closed
+    if (dev->m_data_fd >= 0)
+	epoll_ctl(m_epoll, EPOLL_CTL_DEL, dev->m_data_fd, 0);
+    Lock lock(m_mutex);
+    m_devices.remove(dev, false);
+    for (unsigned int i = 0; i < DC_WHEEL_SLOTS; i++)
+    {
+	ObjList* l = m_wheel[i].skipNull();
+	while (l)
+	{
+	    if (static_cast<ATTimer*>(l->get())->m_dev == dev)
+	    {
+		l->remove();
+		l = l->skipNull();
+	    }
+	    else
+		l = l->skipNext();
+	}
+    }
+}
+
+void ATReactor::schedule(CardDevice* dev, u_int64_t when)
+{
+    u_int64_t tick = (when + DC_REACTOR_TICK - 1) / DC_REACTOR_TICK;
+    Lock lock(m_mutex);
+    m_wheel[tick % DC_WHEEL_SLOTS].append(new ATTimer(dev, when));
+}
+
+void ATReactor::expire(u_int64_t now)
+{
+    u_int64_t tick = now / DC_REACTOR_TICK;
+    ObjList devices;
+    m_mutex.lock();
+    // Never go round more than once, a full turn visits every slot
+    if (tick - m_wheelTick > DC_WHEEL_SLOTS)
+	m_wheelTick = tick - DC_WHEEL_SLOTS;
+    while (m_wheelTick < tick)
+    {
+	m_wheelTick++;
+	ObjList* l = m_wheel[m_wheelTick % DC_WHEEL_SLOTS].skipNull();
+	while (l)
+	{
+	    ATTimer* t = static_cast<ATTimer*>(l->get());
+	    if (t->m_when > now)
+	    {
+		// Due on a later turn of the wheel
+		l = l->skipNext();
+		continue;
+	    }
+	    if (!devices.find(t->m_dev))
+		devices.append(t->m_dev)->setDelete(false);
+	    l->remove();
+	    l = l->skipNull();
+	}
+    }
+    m_mutex.unlock();
+
+    for (ObjList* l = devices.skipNull(); l; l = l->skipNext())
+	static_cast<CardDevice*>(l->get())->atExpire(now);
+}
+
+void ATReactor::update(CardDevice* dev)
 {
-    char* p = buf;
-    ssize_t out_count;
+    unsigned int events = EPOLLIN;
+    if (dev->atWantWrite())
+	events |= EPOLLOUT;
+    if (events == dev->m_at_events || dev->m_data_fd < 0)
+	return;
 
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = dev;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_MOD, dev->m_data_fd, &ev) == 0)
+	dev->m_at_events = events;
+}
+
+unsigned int ATReactor::load()
+{
+    Lock lock(m_mutex);
+    return m_devices.count();
+}
+
+void ATReactor::stop()
+{
+    m_running = false;
+}
+
+void ATReactor::run()
+{
+    struct epoll_event events[DC_REACTOR_EVENTS];
+    u_int64_t tick = 0;
+
+    while (m_running)
+    {
+	int n = epoll_wait(m_epoll, events, DC_REACTOR_EVENTS, DC_REACTOR_TICK);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    Debug(DebugWarn, "ATReactor %u: epoll_wait() error: %d", m_index, errno);
+	    Thread::msleep(DC_REACTOR_TICK);
+	    continue;
+	}
+	for (int i = 0; i < n; i++)
+	    static_cast<CardDevice*>(events[i].data.ptr)->atEvent(events[i].events);
+
+	u_int64_t now = Time::msecNow();
+	expire(now);
+	// Link and idle checks of all devices need no finer resolution
+	if (now < tick)
+	    continue;
+	tick = now + 1000;
+
+	// Devices may detach while we run their timers
+	ObjList devices;
+	m_mutex.lock();
+	for (ObjList* l = m_devices.skipNull(); l; l = l->skipNext())
+	    devices.append(l->get())->setDelete(false);
+	m_mutex.unlock();
+	for (ObjList* l = devices.skipNull(); l; l = l->skipNext())
+	    static_cast<CardDevice*>(l->get())->atTimer(now);
+    }
+}
+
+// Result and unsolicited code prefixes, longest matching prefix wins
+static const struct {
+    const char* prefix;
+    at_res_t res;
+} s_results[] = {
+    { "^STIN:", RES_STIN },
+    { "^BOOT:", RES_BOOT },
+    { "+CNUM:", RES_CNUM },
+    { "ERROR+CNUM:", RES_CNUM },
+    { "OK", RES_OK },
+    { "^RSSI:", RES_RSSI },
+    { "^MODE:", RES_MODE },
+    { "^CEND:", RES_CEND },
+    { "+CSSI:", RES_CSSI },
+    { "^ORIG:", RES_ORIG },
+    { "^CONF:", RES_CONF },
+    { "^CONN:", RES_CONN },
+    { "+CREG:", RES_CREG },
+    { "+COPS:", RES_COPS },
+    { "^SRVST:", RES_SRVST },
+    { "+CSQ:", RES_CSQ },
+    { "+CPIN:", RES_CPIN },
+    { "RING", RES_RING },
+    { "+CLIP:", RES_CLIP },
+    { "ERROR", RES_ERROR },
+    { "+CMTI:", RES_CMTI },
+    { "+CMGR:", RES_CMGR },
+    { "+CMGL:", RES_CMGL },
+    { "+CSSU:", RES_CSSU },
+    { "BUSY", RES_BUSY },
+    { "NO DIALTONE", RES_NO_DIALTONE },
+    { "NO CARRIER", RES_NO_CARRIER },
+    { "COMMAND NOT SUPPORT", RES_ERROR },
+    { "+CMS ERROR:", RES_CMS_ERROR },
+    { "^SMMEMFULL:", RES_SMMEMFULL },
+    { "> ", RES_SMS_PROMPT },
+    { "+CUSD:", RES_CUSD },
+    { "+CPMS:", RES_CPMS },
+    { 0, RES_UNKNOWN },
+};
+
+// Prefix trie over s_results stored as a dense transition table, so a line
+// is classified with one lookup per character whatever the number of prefixes
+class ResultTrie
+{
+public:
+    ResultTrie();
+    at_res_t find(const char* str) const;
+private:
+    void add(const char* prefix, at_res_t res);
+    unsigned char m_symbol[256];	// character to column, 0 if in no prefix
+    unsigned char m_next[DC_TRIE_STATES][DC_TRIE_SYMBOLS];	// 0 is the dead state
+    signed char m_res[DC_TRIE_STATES];	// RES_UNKNOWN if no prefix ends here
+    unsigned int m_states;
+    unsigned int m_symbols;
+};
+
+ResultTrie::ResultTrie()
+    : m_states(2), m_symbols(1)
+{
+    memset(m_symbol, 0, sizeof(m_symbol));
+    memset(m_next, 0, sizeof(m_next));
+    memset(m_res, RES_UNKNOWN, sizeof(m_res));
+    for (int i = 0; s_results[i].prefix; i++)
+	add(s_results[i].prefix, s_results[i].res);
+}
+
+void ResultTrie::add(const char* prefix, at_res_t res)
+{
+    unsigned int state = 1;
+    for (const unsigned char* p = (const unsigned char*)prefix; *p; p++)
+    {
+	if (!m_symbol[*p])
+	{
+	    if (m_symbols >= DC_TRIE_SYMBOLS)
+	    {
+		Debug(DebugWarn, "Result classifier full, '%s' not added", prefix);
+		return;
+	    }
+	    m_symbol[*p] = m_symbols++;
+	}
+	unsigned char& next = m_next[state][m_symbol[*p]];
+	if (!next)
+	{
+	    if (m_states >= DC_TRIE_STATES)
+	    {
+		Debug(DebugWarn, "Result classifier full, '%s' not added", prefix);
+		return;
+	    }
+	    next = m_states++;
+	}
+	state = next;
+    }
+    m_res[state] = res;
+}
+
+at_res_t ResultTrie::find(const char* str) const
+{
+    int res = RES_UNKNOWN;
+    unsigned int state = 1;
+    for (const unsigned char* p = (const unsigned char*)str; ; p++)
+    {
+	// NUL and characters outside all prefixes lead to the dead state
+	state = m_next[state][m_symbol[*p]];
+	if (!state)
+	    break;
+	if (m_res[state] != RES_UNKNOWN)
+	    res = m_res[state];
+    }
+    return (at_res_t)res;
+}
+
+static const ResultTrie s_resultTrie;
+
+at_res_t CardDevice::at_read_result_classification (const char* command)
+{
+    return s_resultTrie.find(command);
+}
+
+
+int CardDevice::at_write_full(char* buf, size_t count)
+{
     Debug(DebugAll, "[%s] [%.*s]", c_str(), (int)count, buf);
 
-    while (count > 0)
+    if (m_wr_buff_len + count + 1 > WRBUFF_MAX)
     {
-	if ((out_count = write(m_data_fd, p, count)) == -1)
+	Debug(DebugAll, "[%s] output buffer full, %u bytes pending", c_str(), m_wr_buff_len);
+	return -1;
+    }
+    ::memcpy(m_wr_buff + m_wr_buff_len, buf, count);
+    m_wr_buff_len += count;
+    m_wr_buff[m_wr_buff_len++] = '\r';
+    return atFlush();
+}
+
+int CardDevice::atOutput(const char* buf, size_t count)
+{
+    if (m_wr_buff_len + count > WRBUFF_MAX)
+	return -1;
+    ::memcpy(m_wr_buff + m_wr_buff_len, buf, count);
+    m_wr_buff_len += count;
+    return atFlush();
+}
+
+int CardDevice::atFlush()
+{
+    unsigned int pos = 0;
+    while (pos < m_wr_buff_len)
+    {
+	ssize_t out_count = write(m_data_fd, m_wr_buff + pos, m_wr_buff_len - pos);
+	if (out_count < 0)
 	{
+	    if (errno == EINTR)
+		continue;
+	    // Wedged or flow controlled modem, the rest goes when it is writable
+	    if (errno == EAGAIN)
+		break;
 	    Debug(DebugAll, "[%s] write() error: %d", c_str(), errno);
+	    m_wr_buff_len = 0;
 	    return -1;
 	}
-
-	count -= out_count;
-	p += out_count;
+	pos += out_count;
     }
-    write(m_data_fd, "\r", 1);
-
+    m_wr_buff_len -= pos;
+    if (pos && m_wr_buff_len)
+	::memmove(m_wr_buff, m_wr_buff + pos, m_wr_buff_len);
     return 0;
 }
 
 int CardDevice::at_send_sms_text(const char* pdu)
 {
     char buf[1024];
-    int ret = snprintf(buf, 1024, "%s\x1a", pdu);
-    if(ret == 1024)
+    int ret = snprintf(buf, sizeof(buf), "%s\x1a", pdu);
+    if(ret < 0 || ret >= (int)sizeof(buf))
 	return -1;
 
     return at_write_full(buf, ret);
@@ -153,6 +153,9 @@ const char* CardDevice::at_cmd2str(at_cmd_t cmd)
 		case CMD_AT_CSMP:
 		    return "AT+CSMP";
 
+		case CMD_AT_CMGL:
+			return "AT+CMGL";
+
 		default:
 			return "UNDEFINED";
 	}
@@ -210,6 +213,9 @@ const char* CardDevice::at_res2str(at_res_t res)
 		case RES_CMTI:
 			return "+CMTI";
 
+		case RES_CMGL:
+			return "+CMGL";
+
 		case RES_CMGR:
 			return "+CMGR";
 
@@ -508,6 +514,24 @@ int CardDevice::at_parse_cmgr(char* str, size_t len, int* stat, int* pdulen)
 	return 0;
 }
 
+int CardDevice::at_parse_cmgl(char* str, size_t len, int* index, int* stat, int* pdulen)
+{
+
+	/*
+	 * parse cmgl info in the following format:
+	 * +CMGL: <index>,<stat>,[<alpha>],<length>
+	 * +CMGL: 3,1,,22
+	 */
+
+	if (sscanf(str, "+CMGL: %d,%d,%*[^,],%d", index, stat, pdulen) != 3
+	    && sscanf(str, "+CMGL: %d,%d,,%d", index, stat, pdulen) != 3)
+	{
+	    Debug(DebugAll, "[%s] Error parsing CMGL event '%s'\n", c_str(), str);
+	    return -1;
+	}
+	return 0;
+}
+
 int CardDevice::at_parse_cusd(char* str, size_t len, String &cusd, unsigned char &dcs)
 {
     /*
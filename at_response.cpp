@@ -96,6 +96,9 @@ int CardDevice::at_response(char* str, at_res_t at_res)
 	case RES_CMGR:
 	    return at_response_cmgr(str, len);
 
+	case RES_CMGL:
+	    return at_response_cmgl(str, len);
+
 	case RES_SMS_PROMPT:
 	    return at_response_sms_prompt();
 
@@ -149,6 +152,9 @@ int CardDevice::at_response(char* str, at_res_t at_res)
 		    case CMD_AT_CMGR:
 			Debug(DebugAll,  "[%s] Got AT+CMGR data (SMS PDU data)", c_str());
 			return at_response_pdu(str, len);
+		    case CMD_AT_CMGL:
+			Debug(DebugAll,  "[%s] Got AT+CMGL data (SMS PDU data)", c_str());
+			return at_response_pdu(str, len);
 		    default:
 			Debug(DebugAll, "[%s] Ignoring unknown result: '%.*s'", c_str(), (int) len, str);
 			break;
@@ -174,76 +180,76 @@ int CardDevice::at_response_ok()
 		if(!m_initialized)
 		{
 		    if(m_reset_datacard)
-			m_commandQueue.append(new ATCommand("ATZ", CMD_AT_Z));
+			queueCommand(new ATCommand("ATZ", CMD_AT_Z));
 		    else
-			m_commandQueue.append(new ATCommand("ATE0", CMD_AT_E));
+			queueCommand(new ATCommand("ATE0", CMD_AT_E));
 		}
 		break;
 		
 	    case CMD_AT_Z:
-	        m_commandQueue.append(new ATCommand("ATE0", CMD_AT_E));
+	        queueCommand(new ATCommand("ATE0", CMD_AT_E));
 		break;
 
 	    case CMD_AT_E:
 		if(!m_initialized)
 		{
 		    if(m_u2diag != -1)
-		        m_commandQueue.append(new ATCommand("AT^U2DIAG=" + String(m_u2diag), CMD_AT_U2DIAG));
+		        queueCommand(new ATCommand("AT^U2DIAG=" + String(m_u2diag), CMD_AT_U2DIAG));
 		    else
-		        m_commandQueue.append(new ATCommand("AT+CGMI", CMD_AT_CGMI));
+		        atQueueIdentity();
 		}
 		break;
 
 	    case CMD_AT_U2DIAG:
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CGMI", CMD_AT_CGMI));
+		    atQueueIdentity();
 		break;
 
+	    /* pipelined identity queries are all queued at once */
 	    case CMD_AT_CGMI:
-		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CGMM", CMD_AT_CGMM));
+		if(!m_initialized && !m_lastcmd->m_pipeline)
+		    queueCommand(new ATCommand("AT+CGMM", CMD_AT_CGMM));
 		break;
 
 	    case CMD_AT_CGMM:
-		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CGMR", CMD_AT_CGMR));
+		if(!m_initialized && !m_lastcmd->m_pipeline)
+		    queueCommand(new ATCommand("AT+CGMR", CMD_AT_CGMR));
 		break;
 
 	    case CMD_AT_CGMR:
-		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CMEE=0", CMD_AT_CMEE));
+		if(!m_initialized && !m_lastcmd->m_pipeline)
+		    queueCommand(new ATCommand("AT+CMEE=0", CMD_AT_CMEE));
 		break;
 		
 	    case CMD_AT_CMEE:
-		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CGSN", CMD_AT_CGSN));
+		if(!m_initialized && !m_lastcmd->m_pipeline)
+		    queueCommand(new ATCommand("AT+CGSN", CMD_AT_CGSN));
 		break;
 
 	    case CMD_AT_CGSN:
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CPIN?", CMD_AT_CPIN));
+		    queueCommand(new ATCommand("AT+CPIN?", CMD_AT_CPIN));
 		break;
 
 	    case CMD_AT_CIMI:
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+COPS=0,0", CMD_AT_COPS_INIT));
+		    queueCommand(new ATCommand("AT+COPS=0,0", CMD_AT_COPS_INIT));
 		break;
 
 	    case CMD_AT_CPIN:
 		if(!m_initialized)
 		{
 		    if(m_simstatus == 0)
-		        m_commandQueue.append(new ATCommand("AT+CIMI", CMD_AT_CIMI));
+		        queueCommand(new ATCommand("AT+CIMI", CMD_AT_CIMI));
 		    else if(m_simstatus == 1 && (m_sim_pin.length() > 0) && (m_pincount == 0))
 		    {
 			m_pincount++;
-			m_commandQueue.append(new ATCommand("AT+CPIN=" + m_sim_pin, CMD_AT_CPIN_ENTER));
+			queueCommand(new ATCommand("AT+CPIN=" + m_sim_pin, CMD_AT_CPIN_ENTER));
 		    }
 		    else
 		    {
 			Debug(DebugAll, "[%s] Wrong SIM State", c_str());
-			m_lastcmd->destruct();
-			m_lastcmd = 0;
+			atCommandDone();
 			return -1;
 		    }
 
@@ -252,63 +258,63 @@ int CardDevice::at_response_ok()
 
 	    case CMD_AT_CPIN_ENTER:
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CPIN?", CMD_AT_CPIN));
+		    queueCommand(new ATCommand("AT+CPIN?", CMD_AT_CPIN));
 		break;
 
 	    case CMD_AT_COPS_INIT:
 		Debug(DebugAll, "[%s] Operator select parameters set", c_str());
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CREG=2", CMD_AT_CREG_INIT));
+		    queueCommand(new ATCommand("AT+CREG=2", CMD_AT_CREG_INIT));
 		break;
 
 	    case CMD_AT_CREG_INIT:
 		Debug(DebugAll,  "[%s] registration info enabled", c_str());
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CREG?", CMD_AT_CREG));
+		    queueCommand(new ATCommand("AT+CREG?", CMD_AT_CREG));
 		break;
 
 	    case CMD_AT_CREG:
 		Debug(DebugAll, "[%s] registration query sent", c_str());
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CNUM", CMD_AT_CNUM));
+		    queueCommand(new ATCommand("AT+CNUM", CMD_AT_CNUM));
 		break;
 
 	    case CMD_AT_CNUM:
 		Debug(DebugAll, "[%s] Subscriber phone number query successed", c_str());
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT^CVOICE?", CMD_AT_CVOICE));
+		    queueCommand(new ATCommand("AT^CVOICE?", CMD_AT_CVOICE));
 		break;
 
 	    case CMD_AT_CVOICE:
 		Debug(DebugAll, "[%s] Datacard has voice support", c_str());
 		m_has_voice = 1;
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CLIP=1", CMD_AT_CLIP));
+		    queueCommand(new ATCommand("AT+CLIP=1", CMD_AT_CLIP));
 		break;
 
 	    case CMD_AT_CLIP:
 		Debug(DebugAll, "[%s] Calling line indication enabled", c_str());
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CSSN=1,1", CMD_AT_CSSN));
+		    queueCommand(new ATCommand("AT+CSSN=1,1", CMD_AT_CSSN));
 		break;
 
 	    case CMD_AT_CSSN:
 		Debug(DebugAll, "[%s] Supplementary Service Notification enabled successful", c_str());
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CMGF=0", CMD_AT_CMGF));
+		    queueCommand(new ATCommand("AT+CMGF=0", CMD_AT_CMGF));
 		break;
 
 	    case CMD_AT_CMGF:
 		Debug(DebugAll, "[%s] SMS PDU mode enabled", c_str());
 		m_use_ucs2_encoding = 1;
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CPMS=\"ME\",\"ME\",\"ME\"", CMD_AT_CPMS));
+		    queueCommand(new ATCommand("AT+CPMS=\"ME\",\"ME\",\"ME\"", CMD_AT_CPMS));
 		break;
 
 	    case CMD_AT_CPMS:
 		Debug(DebugAll,  "[%s] SMS storage location is established", c_str());
 		if(!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CNMI=2,1,0,0,0", CMD_AT_CNMI));
+		    queueCommand(new ATCommand("AT+CNMI=2,1,0,0,0", CMD_AT_CNMI));
 		break;
 
 	    case CMD_AT_CNMI:
@@ -317,17 +323,19 @@ int CardDevice::at_response_ok()
 		m_has_sms = 1;
 		if(!m_initialized)
 		{
-		    m_commandQueue.append(new ATCommand("AT+CSQ", CMD_AT_CSQ));
+		    queueCommand(new ATCommand("AT+CSQ", CMD_AT_CSQ));
 		    m_initialized = 1;
+		    // Messages that arrived while we were away
+		    if(m_cpms)
+			smsDrain();
 		}
 		break;
 	    /* end initilization stuff */
 
 	    case CMD_AT_A:
 		Debug(DebugAll,  "[%s] Answer sent successfully", c_str());
-		//FIXME: Clear audio bufer
-		m_audio_buf.clear();
-		m_commandQueue.append(new ATCommand("AT^DDSETEX=2", CMD_AT_DDSETEX));
+		m_jitter.flush();
+		queueCommand(new ATCommand("AT^DDSETEX=2", CMD_AT_DDSETEX));
 		break;
 
 	    case CMD_AT_CLIR:
@@ -335,13 +343,13 @@ int CardDevice::at_response_ok()
 		if(m_lastcmd->get())
 		{
 		    String* number = static_cast<String*>(m_lastcmd->get());
-		    m_commandQueue.append(new ATCommand("ATD" + *number  + ";", CMD_AT_D));
+		    queueCommand(new ATCommand("ATD" + *number  + ";", CMD_AT_D));
 		}
 		break;
 
 	    case CMD_AT_D:
 		Debug(DebugAll,  "[%s] Dial sent successfully", c_str());
-		m_commandQueue.append(new ATCommand("AT^DDSETEX=2", CMD_AT_DDSETEX));
+		queueCommand(new ATCommand("AT^DDSETEX=2", CMD_AT_DDSETEX));
 		break;
 
 	    case CMD_AT_DDSETEX:
@@ -354,6 +362,11 @@ int CardDevice::at_response_ok()
 
 	    case CMD_AT_CMGS:
 		Debug(DebugAll, "[%s] Successfully sent sms message", c_str());
+		m_sms_parts++;
+		if(m_budget)
+		    m_endpoint->chargeSMS(m_budget);
+		static_cast<SMSCommand*>(m_lastcmd)->sent();
+		smsPump();
 		break;
 
 	    case CMD_AT_DTMF:
@@ -375,11 +388,21 @@ int CardDevice::at_response_ok()
 		    if(m_lastcmd->get())
 		    {
 			String* index = static_cast<String*>(m_lastcmd->get());
-			m_commandQueue.append(new ATCommand("AT+CMGD=" + *index, CMD_AT_CMGD));
+			queueCommand(new ATCommand("AT+CMGD=" + *index, CMD_AT_CMGD));
 		    }
 		}
 		break;
 
+	    case CMD_AT_CMGL:
+		Debug(DebugAll, "[%s] Read %u stored SMS messages", c_str(), m_sms_listed);
+		m_sms_drain = false;
+		m_incoming_pdu = false;
+		m_cpms = 0;
+		// Everything listed is read now, delete it in one go
+		if(m_auto_delete_sms && m_sms_listed)
+		    queueCommand(new ATCommand("AT+CMGD=1,1", CMD_AT_CMGD));
+		break;
+
 	    case CMD_AT_CMGD:
 		Debug(DebugAll, "[%s] SMS message deleted successfully", c_str());
 		break;
@@ -400,7 +423,7 @@ int CardDevice::at_response_ok()
 		if (m_volume_synchronized == 0)
 		{
 		    m_volume_synchronized = 1;
-		    m_commandQueue.append(new ATCommand("AT+CLVL=5", CMD_AT_CLVL));
+		    queueCommand(new ATCommand("AT+CLVL=5", CMD_AT_CLVL));
 		}
 		break;
 
@@ -409,8 +432,7 @@ int CardDevice::at_response_ok()
 		break;
 	}
 	
-	m_lastcmd->destruct();
-	m_lastcmd = 0;
+	atCommandDone();
 
     }
     else if (m_lastcmd)
@@ -481,7 +503,7 @@ int CardDevice::at_response_error()
 	    case CMD_AT_CREG:
 		Debug(DebugAll, "[%s] Error getting registration info", c_str());
 		if (!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CNUM", CMD_AT_CNUM));
+		    queueCommand(new ATCommand("AT+CNUM", CMD_AT_CNUM));
 		break;
 
 	    case CMD_AT_CNUM:
@@ -493,7 +515,7 @@ int CardDevice::at_response_error()
 		Debug(DebugAll, "[%s] Datacard has NO voice support", c_str());
 		m_has_voice = 0;
 		if (!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CMGF=0", CMD_AT_CMGF));
+		    queueCommand(new ATCommand("AT+CMGF=0", CMD_AT_CMGF));
 		break;
 
 	    case CMD_AT_CLIP:
@@ -514,7 +536,7 @@ int CardDevice::at_response_error()
 		{
 		    if (m_has_voice)
 		    {
-			m_commandQueue.append(new ATCommand("AT+CSQ", CMD_AT_CSQ));
+			queueCommand(new ATCommand("AT+CSQ", CMD_AT_CSQ));
 			m_initialized = 1;
 			Debug(DebugAll, "Datacard %s initialized and ready", c_str());
 		    }
@@ -527,7 +549,7 @@ int CardDevice::at_response_error()
 		m_use_ucs2_encoding = 0;
 		/* set SMS storage location */
 		if (!m_initialized)
-		    m_commandQueue.append(new ATCommand("AT+CPMS=\"ME\",\"ME\",\"ME\"", CMD_AT_CPMS));
+		    queueCommand(new ATCommand("AT+CPMS=\"ME\",\"ME\",\"ME\"", CMD_AT_CPMS));
 		break;
 	    /* end initilization stuff */
 
@@ -542,7 +564,7 @@ int CardDevice::at_response_error()
 		if(m_lastcmd->get())
 		{
 		    String* number = static_cast<String*>(m_lastcmd->get());
-		    m_commandQueue.append(new ATCommand("ATD" + *number + ";", CMD_AT_D));
+		    queueCommand(new ATCommand("ATD" + *number + ";", CMD_AT_D));
 		}
 		break;
 
@@ -569,8 +591,16 @@ int CardDevice::at_response_error()
 		Debug(DebugAll, "[%s] Error deleting SMS message", c_str());
 		break;
 
+	    case CMD_AT_CMGL:
+		Debug(DebugAll, "[%s] Error listing stored SMS messages", c_str());
+		m_sms_drain = false;
+		m_incoming_pdu = false;
+		break;
+
 	    case CMD_AT_CMGS:
 		Debug(DebugAll, "[%s] Error sending SMS message", c_str());
+		m_sms_errors++;
+		static_cast<SMSCommand*>(m_lastcmd)->failed();
 		break;
 
 	    case CMD_AT_DTMF:
@@ -595,8 +625,7 @@ int CardDevice::at_response_error()
 		break;
 	}
 
-	m_lastcmd->destruct();
-	m_lastcmd = 0;
+	atCommandDone();
     }
     else if (m_lastcmd)
     {
@@ -610,8 +639,7 @@ int CardDevice::at_response_error()
     return 0;
 
 e_return:
-    m_lastcmd->destruct();
-    m_lastcmd = 0;
+    atCommandDone();
 
     return -1;
 }
@@ -662,7 +690,7 @@ int CardDevice::at_response_orig(char* str, size_t len)
     if(m_conn)
 	m_conn->onProgress();
 
-    m_commandQueue.append(new ATCommand("AT+CLVL=1", CMD_AT_CLVL));
+    queueCommand(new ATCommand("AT+CLVL=1", CMD_AT_CLVL));
     m_volume_synchronized = 0;
     return 0;
 }
@@ -691,6 +719,10 @@ int CardDevice::at_response_cend(char* str, size_t len)
 
     Debug(DebugAll, "[%s] Line disconnected", c_str());
 
+    // Operators limit the outgoing minutes of a SIM
+    if(m_outgoing && duration > 0 && m_budget)
+	m_endpoint->chargeCall(m_budget, duration);
+
     m_needchup = 0;
 //TODO:
 
@@ -730,8 +762,7 @@ int CardDevice::at_response_conn(char* str, size_t len)
     if(m_outgoing)
     {
 	Debug(DebugAll, "[%s] Remote end answered", c_str());
-	//FIXME: Clear audio bufer
-	m_audio_buf.clear();
+	m_jitter.flush();
 	if(m_conn)
 	    m_conn->onAnswered();
     }
@@ -749,7 +780,7 @@ int CardDevice::at_response_clip(char* str, size_t len)
 	if(incomingCall(clip) == false)
 	{
 	    Debug(DebugAll, "[%s] Unable to allocate channel for incoming call", c_str());
-	    m_commandQueue.append(new ATCommand("AT+CHUP", CMD_AT_CHUP));
+	    queueCommand(new ATCommand("AT+CHUP", CMD_AT_CHUP));
 	    return -1;
 	}
 	m_needchup = 1;
@@ -765,7 +796,7 @@ int CardDevice::at_response_ring()
 	/* We only want to syncronize volume on the first ring */
 	if(!m_incoming)
 	{
-	    m_commandQueue.append(new ATCommand("AT+CLVL=1", CMD_AT_CLVL));
+	    queueCommand(new ATCommand("AT+CLVL=1", CMD_AT_CLVL));
 	    m_volume_synchronized = 0;
 	}
 	m_incoming = 1;
@@ -788,7 +819,7 @@ int CardDevice::at_response_cmti(char* str, size_t len)
     if (m_disablesms)
         Debug(DebugAll, "[%s] SMS reception has been disabled in the configuration.", c_str());
     else
-        m_commandQueue.append(new ATCommand("AT+CMGR=" + String(index), CMD_AT_CMGR, new String(index)));
+        queueCommand(new ATCommand("AT+CMGR=" + String(index), CMD_AT_CMGR, new String(index)));
     return 0;
 }
 
@@ -803,6 +834,30 @@ int CardDevice::at_response_cmgr(char* str, size_t len)
     return 0;
 }
 
+int CardDevice::at_response_cmgl(char* str, size_t len)
+{
+    int index = 0;
+    int stat = 0;
+    int pdulen = 0;
+    if (at_parse_cmgl(str, len, &index, &stat, &pdulen))
+	return 0;
+    Debug(DebugAll, "[%s] Stored SMS message %d, stat = %d, pdulen = %d", c_str(), index, stat, pdulen);
+    m_sms_listed++;
+    m_incoming_pdu = true;
+    return 0;
+}
+
+void CardDevice::smsDrain()
+{
+    if (m_sms_drain || m_disablesms)
+	return;
+    m_sms_drain = true;
+    m_sms_listed = 0;
+    // Without autodelete read messages stay stored, list only the unread
+    // ones or they would be delivered again on every reconnect
+    queueCommand(new ATCommand(m_auto_delete_sms ? "AT+CMGL=4" : "AT+CMGL=0", CMD_AT_CMGL));
+}
+
 int CardDevice::at_response_sms_prompt()
 {
     if(m_lastcmd && (m_lastcmd->m_cmd == CMD_AT_CMGS))
@@ -890,8 +945,7 @@ int CardDevice::at_response_no_carrier()
 
     if(m_lastcmd && m_lastcmd->m_cmd == CMD_AT_A)
     {	
-	m_lastcmd->destruct();
-	m_lastcmd = 0;
+	atCommandDone();
     }
 
     Debug(DebugAll, "[%s] Datacard reports 'NO CARRIER'", c_str());
@@ -909,6 +963,8 @@ int CardDevice::at_response_cpin(char* str, size_t len)
 int CardDevice::at_response_smmemfull()
 {
     Debug(DebugAll, "[%s] SMS storage is full", c_str());
+    if (m_initialized && m_has_sms)
+	smsDrain();
     return 0;
 }
 
@@ -947,7 +1003,7 @@ int CardDevice::at_response_creg(char* str, size_t len)
     char* lac;
     char* ci;
 
-    m_commandQueue.append(new ATCommand("AT+COPS?", CMD_AT_COPS));
+    queueCommand(new ATCommand("AT+COPS?", CMD_AT_COPS));
 
     if(at_parse_creg(str, len, &d, &m_gsm_reg_status, &lac, &ci))
     {
@@ -996,12 +1052,14 @@ int CardDevice::at_response_cgmr(char* str, size_t len)
 int CardDevice::at_response_cgsn(char* str, size_t len)
 {
     m_imei.assign(str,len);
+    m_endpoint->indexDevice(this);
     return 0;
 }
 
 int CardDevice::at_response_cimi(char* str, size_t len)
 {
     m_imsi.assign(str,len);
+    m_endpoint->indexDevice(this);
     return 0;
 }
 
@@ -1014,7 +1072,8 @@ int CardDevice::at_response_pdu(char* str, size_t len)
 	if(!receiveSMS(str, len))
 	{
 	    Debug(DebugAll, "[%s] Error parse SMS message", c_str());
-	    return 1;
+	    // A broken stored message must not stop the list
+	    return m_sms_drain ? 0 : 1;
 	}
 	Debug(DebugAll, "[%s] Successfully parse SMS message", c_str());
     }
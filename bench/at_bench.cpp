@@ -0,0 +1,243 @@
+/**
+ * at_bench.cpp
+ * This file is part of the Yate-datacard Project http://code.google.com/p/yate-datacard/
+ * Yate datacard channel driver for Huawei UMTS modem
+ *
+ * Benchmark of the AT receive path over a recorded line corpus: result
+ * classification, at_response() and the at_parse_* functions
+ *
+ * Copyright (C) 2010-2011 MBloody
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "datacarddevice.h"
+#include "bench.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace TelEngine;
+
+#define BENCH_LINES	4096
+#define BENCH_ROUNDS	20000
+// Lines timed one by one for the latency percentiles
+#define BENCH_SAMPLES	100000
+
+enum bench_op_t {
+    OP_CLASSIFY,
+    OP_RESPONSE,
+    OP_PARSE,
+};
+
+static const struct {
+    const char* name;
+    bench_op_t op;
+    at_res_t res;	// only lines of this class, RES_UNKNOWN for all
+} s_stages[] = {
+    { "classify", OP_CLASSIFY, RES_UNKNOWN },
+    { "response", OP_RESPONSE, RES_UNKNOWN },
+    { "parse CREG", OP_PARSE, RES_CREG },
+    { "parse CUSD", OP_PARSE, RES_CUSD },
+    { "parse CMTI", OP_PARSE, RES_CMTI },
+    { "parse CLIP", OP_PARSE, RES_CLIP },
+    { "parse COPS", OP_PARSE, RES_COPS },
+    { "parse CNUM", OP_PARSE, RES_CNUM },
+    { "parse CSQ", OP_PARSE, RES_CSQ },
+    { "parse RSSI", OP_PARSE, RES_RSSI },
+    { "parse MODE", OP_PARSE, RES_MODE },
+    { 0, OP_CLASSIFY, RES_UNKNOWN },
+};
+
+static char* s_lines[BENCH_LINES];
+static at_res_t s_res[BENCH_LINES];
+static unsigned int s_count = 0;
+
+/**
+ * Drives the private receive path of a device that is never connected
+ */
+class ATBench
+{
+public:
+    ATBench(CardDevice* dev)
+	: m_dev(dev)
+	{ }
+
+    /**
+     * Run one operation over a copy of a corpus line, parsers modify it
+     * @param op - operation to run
+     * @param index - corpus line
+     * @return operation result, accumulated so it is not optimized away
+     */
+    int run(bench_op_t op, unsigned int index);
+
+private:
+    int parse(char* str, size_t len, at_res_t res);
+    CardDevice* m_dev;
+    char m_buf[RDBUFF_MAX];
+};
+
+int ATBench::run(bench_op_t op, unsigned int index)
+{
+    const char* line = s_lines[index];
+    if (op == OP_CLASSIFY)
+	return CardDevice::at_read_result_classification(line);
+    size_t len = strlen(line);
+    ::memcpy(m_buf, line, len + 1);
+    if (op == OP_PARSE)
+	return parse(m_buf, len, s_res[index]);
+    int ret = m_dev->at_response(m_buf, CardDevice::at_read_result_classification(m_buf));
+    // Drop commands queued by the handlers, the device is not connected
+    if (m_dev->m_commandQueue.count())
+	m_dev->m_commandQueue.clear();
+    return ret;
+}
+
+int ATBench::parse(char* str, size_t len, at_res_t res)
+{
+    int a = 0;
+    int b = 0;
+    switch (res)
+    {
+	case RES_CREG:
+	{
+	    char* lac;
+	    char* ci;
+	    return m_dev->at_parse_creg(str, len, &a, &b, &lac, &ci) + a + b;
+	}
+	case RES_CUSD:
+	{
+	    String cusd;
+	    unsigned char dcs = 0;
+	    return m_dev->at_parse_cusd(str, len, cusd, dcs) + cusd.length() + dcs;
+	}
+	case RES_CMTI:
+	    return m_dev->at_parse_cmti(str, len);
+	case RES_CLIP:
+	    return m_dev->at_parse_clip(str, len).length();
+	case RES_COPS:
+	    return m_dev->at_parse_cops(str, len) ? 1 : 0;
+	case RES_CNUM:
+	    return m_dev->at_parse_cnum(str, len).length();
+	case RES_CSQ:
+	    return m_dev->at_parse_csq(str, len, &a) + a;
+	case RES_RSSI:
+	    return m_dev->at_parse_rssi(str, len);
+	case RES_MODE:
+	    return m_dev->at_parse_mode(str, len, &a, &b) + a + b;
+	default:
+	    return 0;
+    }
+}
+
+// Load the corpus, one modem line per text line, CR/LF stripped
+static bool loadCorpus(const char* file)
+{
+    FILE* f = fopen(file, "r");
+    if (!f)
+    {
+	fprintf(stderr, "Cannot open corpus '%s'\n", file);
+	return false;
+    }
+    char buf[RDBUFF_MAX];
+    while (s_count < BENCH_LINES && fgets(buf, sizeof(buf), f))
+    {
+	size_t len = strcspn(buf, "\r\n");
+	buf[len] = '\0';
+	if (!len)
+	    continue;
+	s_res[s_count] = CardDevice::at_read_result_classification(buf);
+	s_lines[s_count++] = strdup(buf);
+    }
+    fclose(f);
+    if (!s_count)
+	fprintf(stderr, "Corpus '%s' is empty\n", file);
+    return s_count != 0;
+}
+
+int main(int argc, const char** argv)
+{
+    const char* file = (argc > 1) ? argv[1] : "bench/at_corpus.txt";
+    unsigned int rounds = (argc > 2) ? atoi(argv[2]) : BENCH_ROUNDS;
+    if (!(rounds && loadCorpus(file)))
+	return 1;
+
+    unsigned int known = 0;
+    for (unsigned int i = 0; i < s_count; i++)
+	if (s_res[i] != RES_UNKNOWN)
+	    known++;
+    printf("corpus: %s (%u lines, %u classified, %u unknown), %u rounds\n\n",
+	file, s_count, known, s_count - known, rounds);
+    printf("%-12s %6s %12s %10s %11s %8s %8s\n",
+	"stage", "lines", "lines/s", "ns/line", "allocs/line", "p50 ns", "p99 ns");
+
+    DevicesEndPoint* ep = new DevicesEndPoint(1);
+    CardDevice* dev = new CardDevice("bench", ep);
+    ATBench bench(dev);
+    unsigned int* subset = (unsigned int*)::malloc(s_count * sizeof(unsigned int));
+    u_int64_t* samples = (u_int64_t*)::malloc(BENCH_SAMPLES * sizeof(u_int64_t));
+    long sum = 0;
+
+    for (unsigned int s = 0; s_stages[s].name; s++)
+    {
+	bench_op_t op = s_stages[s].op;
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < s_count; i++)
+	    if (s_stages[s].res == RES_UNKNOWN || s_stages[s].res == s_res[i])
+		subset[n++] = i;
+	if (!n)
+	{
+	    printf("%-12s %6u   (no lines in corpus)\n", s_stages[s].name, n);
+	    continue;
+	}
+
+	// Throughput and allocations over the whole rounds
+	unsigned long allocs = s_allocs;
+	u_int64_t start = nsNow();
+	for (unsigned int r = 0; r < rounds; r++)
+	    for (unsigned int i = 0; i < n; i++)
+		sum += bench.run(op, subset[i]);
+	u_int64_t elapsed = nsNow() - start;
+	allocs = s_allocs - allocs;
+	double total = (double)rounds * n;
+	if (!elapsed)
+	    elapsed = 1;
+
+	// Latency of single lines, clock overhead included
+	unsigned int count = 0;
+	for (unsigned int i = 0; count < BENCH_SAMPLES; i = (i + 1) % n)
+	{
+	    u_int64_t t = nsNow();
+	    sum += bench.run(op, subset[i]);
+	    samples[count++] = nsNow() - t;
+	    if (count >= total)
+		break;
+	}
+	qsort(samples, count, sizeof(u_int64_t), cmpTimes);
+
+	printf("%-12s %6u %12.0f %10.1f %11.2f %8llu %8llu\n",
+	    s_stages[s].name, n, total * 1000000000.0 / elapsed, elapsed / total, allocs / total,
+	    (unsigned long long)samples[count / 2], (unsigned long long)samples[count * 99 / 100]);
+    }
+    printf("\nchecksum %ld\n", sum);
+
+    ::free(samples);
+    ::free(subset);
+    TelEngine::destruct(dev);
+    delete ep;
+    for (unsigned int i = 0; i < s_count; i++)
+	::free(s_lines[i]);
+    return 0;
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
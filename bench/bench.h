@@ -0,0 +1,81 @@
+/**
+ * bench.h
+ * This file is part of the Yate-datacard Project http://code.google.com/p/yate-datacard/
+ * Yate datacard channel driver for Huawei UMTS modem
+ *
+ * Helpers shared by the benchmarks. Include from exactly one source of
+ * each benchmark program, it interposes the process allocator.
+ *
+ * Copyright (C) 2010-2011 MBloody
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdlib.h>
+#include <time.h>
+#include <sys/types.h>
+
+// Count heap allocations of the whole process, Yate and libstdc++ included
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+static unsigned long s_allocs = 0;
+
+void* malloc(size_t size)
+{
+    s_allocs++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    s_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    s_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+    __libc_free(ptr);
+}
+}
+
+static inline u_int64_t nsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmpTimes(const void* a, const void* b)
+{
+    u_int64_t x = *(const u_int64_t*)a;
+    u_int64_t y = *(const u_int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+#endif
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
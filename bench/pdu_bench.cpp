@@ -0,0 +1,358 @@
+/**
+ * pdu_bench.cpp
+ * This file is part of the Yate-datacard Project http://code.google.com/p/yate-datacard/
+ * Yate datacard channel driver for Huawei UMTS modem
+ *
+ * Benchmark of the SMS PDU codec: SMS-SUBMIT generation and SMS-DELIVER
+ * parsing in GSM 7 bit and UCS2, with and without concatenation UDH.
+ * Round trips of split long texts are verified before timing
+ *
+ * Copyright (C) 2010-2011 MBloody
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "pdu.h"
+#include "bench.h"
+#include <stdio.h>
+#include <string.h>
+
+#define BENCH_MESSAGES	200000
+#define BENCH_SAMPLES	100000
+
+// Concatenation UDH, 8 bit reference: part 1 of 2
+#define BENCH_UDH	"05 00 03 A7 02 01"
+#define BENCH_NUMBER	"79161234567"
+
+// 160 and 153 GSM characters, 70 and 67 Cyrillic characters
+static const char s_gsm160[] =
+    "The quick brown fox jumps over the lazy dog while the gateway keeps "
+    "forwarding messages from one modem to another, 0123456789 times a day. "
+    "It must not lose any of them!";
+static const char s_ucs70[] =
+    "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82, \xd1\x8d\xd1\x82\xd0\xbe "
+    "\xd1\x82\xd0\xb5\xd1\x81\xd1\x82\xd0\xbe\xd0\xb2\xd0\xbe\xd0\xb5 "
+    "\xd1\x81\xd0\xbe\xd0\xbe\xd0\xb1\xd1\x89\xd0\xb5\xd0\xbd\xd0\xb8\xd0\xb5 "
+    "\xd0\xb4\xd0\xbb\xd1\x8f \xd0\xb1\xd0\xb5\xd0\xbd\xd1\x87\xd0\xbc\xd0\xb0\xd1\x80\xd0\xba\xd0\xb0 "
+    "PDU \xd0\xba\xd0\xbe\xd0\xb4\xd0\xb5\xd0\xba\xd0\xb0 UCS2!! "
+    "\xd0\xa1\xd0\xbf\xd0\xb0\xd1\x81\xd0\xb8\xd0\xb1\xd0\xbe.";
+
+enum bench_dir_t {
+    DIR_ENCODE,
+    DIR_DECODE,
+};
+
+struct BenchCase {
+    const char* name;
+    bench_dir_t dir;
+    PDU::Alphabet alphabet;
+    const char* udh;
+    const char* text;
+    unsigned int chars;	// characters of text used
+    char pdu[512];	// SMS-DELIVER for decode cases
+};
+
+static BenchCase s_cases[] = {
+    { "encode GSM7", DIR_ENCODE, PDU::GSM, 0, s_gsm160, 160, "" },
+    { "encode GSM7+UDH", DIR_ENCODE, PDU::GSM, BENCH_UDH, s_gsm160, 153, "" },
+    { "encode UCS2", DIR_ENCODE, PDU::UCS2, 0, s_ucs70, 70, "" },
+    { "encode UCS2+UDH", DIR_ENCODE, PDU::UCS2, BENCH_UDH, s_ucs70, 67, "" },
+    { "decode GSM7", DIR_DECODE, PDU::GSM, 0, s_gsm160, 160, "" },
+    { "decode GSM7+UDH", DIR_DECODE, PDU::GSM, BENCH_UDH, s_gsm160, 153, "" },
+    { "decode UCS2", DIR_DECODE, PDU::UCS2, 0, s_ucs70, 70, "" },
+    { "decode UCS2+UDH", DIR_DECODE, PDU::UCS2, BENCH_UDH, s_ucs70, 67, "" },
+};
+
+static const char s_hex[] = "0123456789ABCDEF";
+
+static char* putOctet(char* p, unsigned int val)
+{
+    *p++ = s_hex[(val >> 4) & 0x0f];
+    *p++ = s_hex[val & 0x0f];
+    return p;
+}
+
+static unsigned int hexDigit(char c)
+{
+    return (c <= '9') ? c - '0' : (c & 0x07) + 9;
+}
+
+// Byte length of the first chars UTF-8 characters of text
+static unsigned int utf8Len(const char* text, unsigned int chars)
+{
+    const unsigned char* p = (const unsigned char*)text;
+    while (*p && chars)
+    {
+	p++;
+	while ((*p & 0xc0) == 0x80)
+	    p++;
+	chars--;
+    }
+    return p - (const unsigned char*)text;
+}
+
+// Build an SMS-DELIVER from BENCH_NUMBER without SMSC carrying the case text
+static void buildDeliver(BenchCase& c)
+{
+    unsigned char udh[16];
+    unsigned int udhLen = 0;
+    if (c.udh)
+	for (const char* s = c.udh; *s; s += (s[2] ? 3 : 2))
+	    udh[udhLen++] = (unsigned char)((hexDigit(s[0]) << 4) | hexDigit(s[1]));
+
+    char* p = c.pdu;
+    p = putOctet(p, 0);	// no SMSC
+    p = putOctet(p, c.udh ? 0x44 : 0x04);	// SMS-DELIVER, UDHI
+    p = putOctet(p, strlen(BENCH_NUMBER));
+    p = putOctet(p, 0x91);
+    for (unsigned int i = 0; i < sizeof(BENCH_NUMBER) - 1; i += 2)
+    {
+	*p++ = (i + 1 < sizeof(BENCH_NUMBER) - 1) ? BENCH_NUMBER[i + 1] : 'F';
+	*p++ = BENCH_NUMBER[i];
+    }
+    p = putOctet(p, 0);	// PID
+    p = putOctet(p, (c.alphabet == PDU::UCS2) ? 0x08 : 0x00);
+    memcpy(p, "21207151527000", 14);	// 2012-02-17 15:25:07
+    p += 14;
+
+    if (c.alphabet == PDU::UCS2)
+    {
+	// Plain two byte UCS2, the texts stay in the BMP
+	unsigned char ud[140];
+	unsigned int len = 0;
+	const unsigned char* s = (const unsigned char*)c.text;
+	for (unsigned int i = 0; i < c.chars && *s; i++)
+	{
+	    unsigned int ch = *s++;
+	    if (ch >= 0xc0)
+		ch = ((ch & 0x1f) << 6) | (*s++ & 0x3f);
+	    ud[len++] = ch >> 8;
+	    ud[len++] = ch & 0xff;
+	}
+	p = putOctet(p, udhLen + len);
+	for (unsigned int i = 0; i < udhLen; i++)
+	    p = putOctet(p, udh[i]);
+	for (unsigned int i = 0; i < len; i++)
+	    p = putOctet(p, ud[i]);
+    }
+    else
+    {
+	// Septets start on the first septet boundary after the UDH
+	unsigned int skip = (udhLen * 8 + 6) / 7;
+	p = putOctet(p, skip + c.chars);
+	for (unsigned int i = 0; i < udhLen; i++)
+	    p = putOctet(p, udh[i]);
+	unsigned int acc = 0;
+	int bits = skip * 7 - udhLen * 8;
+	for (unsigned int i = 0; i < c.chars; i++)
+	{
+	    acc |= (unsigned int)(c.text[i] & 0x7f) << bits;
+	    bits += 7;
+	    while (bits >= 8)
+	    {
+		p = putOctet(p, acc & 0xff);
+		acc >>= 8;
+		bits -= 8;
+	    }
+	}
+	if (bits > 0)
+	    p = putOctet(p, acc & 0xff);
+    }
+    *p = '\0';
+}
+
+// Round trip texts: extension table characters, split points next to
+// escapes and surrogate pairs, 8 and 16 bit concatenation references
+static const char* s_verify[] = {
+    "Hello, world! @\xc2\xa3$\xc2\xa5\xc3\xa8\xc3\xa9\xc3\xb9\xc3\xac\xc3\xb2\xc3\x87\xc3\x98\xc3\xb8"
+	"\xc3\x85\xc3\xa5\xce\x94_\xce\xa6\xce\x93\xce\x9b\xce\xa9\xce\xa0\xce\xa8\xce\xa3\xce\x98\xce\x9e"
+	"\xc3\x86\xc3\xa6\xc3\x9f\xc3\x89 !\"#\xc2\xa4%&'()*+,-./0123456789:;<=>?\xc2\xa1"
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZ\xc3\x84\xc3\x96\xc3\x91\xc3\x9c\xc2\xa7\xc2\xbf"
+	"abcdefghijklmnopqrstuvwxyz\xc3\xa4\xc3\xb6\xc3\xb1\xc3\xbc\xc3\xa0",
+    "Extension {braces} [brackets] ~tilde\\backslash|pipe^caret \xe2\x82\xac euro \x0c",
+    s_gsm160,
+    s_ucs70,
+    "\xf0\x9f\x98\x80 surrogate pairs \xf0\x9f\x93\xb1 across \xf0\x9f\x93\xa8 part breaks",
+    0
+};
+
+// Turn the SMS-SUBMIT generate() made into the SMS-DELIVER parse() reads:
+// same SMSC, address, PID, DCS and user data, with a time stamp
+static bool submit2deliver(const char* submit, char* deliver)
+{
+    const char* p = submit;
+    unsigned int smsc = (hexDigit(p[0]) << 4) | hexDigit(p[1]);
+    memcpy(deliver, p, 2 + smsc * 2);
+    char* d = deliver + 2 + smsc * 2;
+    p += 2 + smsc * 2;
+    unsigned int flags = (hexDigit(p[0]) << 4) | hexDigit(p[1]);
+    d = putOctet(d, 0x04 | (flags & 0x40));
+    p += 4;	// first octet, message reference
+    unsigned int digits = (hexDigit(p[0]) << 4) | hexDigit(p[1]);
+    unsigned int addr = 4 + (digits + 1) / 2 * 2;
+    memcpy(d, p, addr + 4);	// address, PID, DCS
+    d += addr + 4;
+    p += addr + 4;
+    if (flags & 0x10)
+	p += 2;	// validity period
+    memcpy(d, "21207151527000", 14);
+    d += 14;
+    strcpy(d, p);
+    return *p != '\0';
+}
+
+// Encode each text as concatenated SMS, decode the parts and compare
+static int verify()
+{
+    int failed = 0;
+    for (unsigned int i = 0; s_verify[i]; i++)
+    {
+	// Three times over, every text spans parts
+	char text[max_message * 4];
+	snprintf(text, sizeof(text), "%s%s%s", s_verify[i], s_verify[i], s_verify[i]);
+	int len = strlen(text);
+	PDU::Alphabet alphabet = (utf8_gsm_septets(text, len) >= 0) ? PDU::GSM : PDU::UCS2;
+	for (int ref16 = 0; ref16 < 2; ref16++)
+	{
+	    int parts[8];
+	    char decoded[max_message * 8];
+	    unsigned int dlen = 0;
+	    int ref = ref16 ? 0x1234 : 0x56;
+	    int count = PDU::split(text, len, alphabet, ref16, parts, 8);
+	    const char* err = (count > 1) ? 0 : "split";
+	    const char* t = text;
+	    for (int n = 0; !err && n < count; n++)
+	    {
+		PDU enc;
+		enc.setMessage(t, parts[n]);
+		enc.setNumber(BENCH_NUMBER);
+		enc.setAlphabet(alphabet);
+		if (count > 1)
+		    enc.setConcat(ref, count, n + 1, ref16);
+		enc.generate();
+		t += parts[n];
+
+		char pdu[max_pdu_hex + 16];
+		if (!submit2deliver(enc.getPDU(), pdu))
+		{
+		    err = "generate";
+		    break;
+		}
+		PDU dec(pdu);
+		if (!dec.parse())
+		{
+		    err = "parse";
+		    break;
+		}
+		int r, c, pt;
+		if (count > 1 && !(dec.getConcat(r, c, pt) && r == ref && c == count && pt == n + 1))
+		{
+		    err = "concatenation UDH";
+		    break;
+		}
+		if (dlen + dec.getMessageLen() >= sizeof(decoded))
+		{
+		    err = "length";
+		    break;
+		}
+		memcpy(decoded + dlen, dec.getMessage(), dec.getMessageLen());
+		dlen += dec.getMessageLen();
+	    }
+	    if (!err && (dlen != (unsigned int)len || memcmp(decoded, text, len)))
+		err = "text";
+	    if (err)
+	    {
+		printf("verify text %u %s %s ref: %s mismatch\n", i,
+		    (alphabet == PDU::UCS2) ? "UCS2" : "GSM7", ref16 ? "16 bit" : "8 bit", err);
+		failed++;
+	    }
+	}
+    }
+    return failed;
+}
+
+static inline int runCase(BenchCase& c, unsigned int len)
+{
+    if (c.dir == DIR_DECODE)
+    {
+	PDU pdu(c.pdu);
+	if (!pdu.parse())
+	    return -1;
+	return pdu.getMessageLen();
+    }
+    PDU pdu;
+    pdu.setMessage(c.text, len);
+    pdu.setNumber(BENCH_NUMBER);
+    pdu.setAlphabet(c.alphabet);
+    if (c.udh)
+	pdu.setUDH(c.udh);
+    pdu.generate();
+    return pdu.getMessageLen();
+}
+
+int main(int argc, const char** argv)
+{
+    unsigned int messages = (argc > 1) ? atoi(argv[1]) : BENCH_MESSAGES;
+    if (!messages)
+	return 1;
+    // A codec that got faster by getting wrong is no win
+    if (verify())
+	return 1;
+    printf("%-16s %12s %10s %10s %8s %8s\n",
+	"case", "msgs/s", "ns/msg", "allocs/msg", "p50 ns", "p99 ns");
+
+    u_int64_t* samples = (u_int64_t*)::malloc(BENCH_SAMPLES * sizeof(u_int64_t));
+    long sum = 0;
+    for (unsigned int i = 0; i < sizeof(s_cases) / sizeof(s_cases[0]); i++)
+    {
+	BenchCase& c = s_cases[i];
+	unsigned int len = (c.alphabet == PDU::UCS2) ? utf8Len(c.text, c.chars) : c.chars;
+	if (c.dir == DIR_DECODE)
+	    buildDeliver(c);
+	int ret = runCase(c, len);
+	if (ret <= 0)
+	{
+	    printf("%-16s failed\n", c.name);
+	    continue;
+	}
+
+	unsigned long allocs = s_allocs;
+	u_int64_t start = nsNow();
+	for (unsigned int n = 0; n < messages; n++)
+	    sum += runCase(c, len);
+	u_int64_t elapsed = nsNow() - start;
+	allocs = s_allocs - allocs;
+	if (!elapsed)
+	    elapsed = 1;
+
+	unsigned int count = (messages < BENCH_SAMPLES) ? messages : BENCH_SAMPLES;
+	for (unsigned int n = 0; n < count; n++)
+	{
+	    u_int64_t t = nsNow();
+	    sum += runCase(c, len);
+	    samples[n] = nsNow() - t;
+	}
+	qsort(samples, count, sizeof(u_int64_t), cmpTimes);
+
+	printf("%-16s %12.0f %10.1f %10.2f %8llu %8llu\n",
+	    c.name, messages * 1000000000.0 / elapsed, (double)elapsed / messages,
+	    (double)allocs / messages,
+	    (unsigned long long)samples[count / 2], (unsigned long long)samples[count * 99 / 100]);
+    }
+    printf("\nchecksum %ld\n", sum);
+    ::free(samples);
+    return 0;
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
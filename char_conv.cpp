@@ -26,6 +26,7 @@
 
 
 #include "datacarddevice.h"
+#include "pdu.h"
 #include <stdio.h>
 #include <string.h>
 #include <iconv.h>
@@ -39,7 +40,8 @@ ssize_t CardDevice::convert_string(const char* in, size_t in_length, char* out,
     iconv_t cd = (iconv_t) -1;
     ssize_t res;
 
-    cd = iconv_open(to, from);
+    // Cached per thread, do not close it
+    cd = iconv_cached(to, from);
     if (cd == (iconv_t) -1)
     {
 	return -2;
@@ -51,8 +53,6 @@ ssize_t CardDevice::convert_string(const char* in, size_t in_length, char* out,
 	return -3;
     }
 
-    iconv_close(cd);
-
     *out_ptr = '\0';
 
     return (out_ptr - out);
@@ -60,11 +60,6 @@ ssize_t CardDevice::convert_string(const char* in, size_t in_length, char* out,
 
 ssize_t CardDevice::hexstr_to_ucs2char(const char* in, size_t in_length, char* out, size_t out_size)
 {
-    size_t i;
-    size_t x;
-    int hexval = 0;
-    char buf[] = "  ";
-
     in_length = in_length / 2;
 
     if(out_size - 1 < in_length)
@@ -72,42 +67,26 @@ ssize_t CardDevice::hexstr_to_ucs2char(const char* in, size_t in_length, char* o
 	return -1;
     }
 
-    for(i = 0, x = 0; i < in_length; i++)
+    if (hex2bin((unsigned char*)out, in, in_length * 2) < 0)
     {
-	memmove(buf, in + i * 2, 2);
-	if (sscanf(buf, "%x", &hexval) != 1)
-	{
-	    return -1;
-	}
-	out[x] = hexval;
-	x++;
+	return -1;
     }
 
-    out[x] = '\0';
-    return x;
+    out[in_length] = '\0';
+    return in_length;
 }
 
 ssize_t CardDevice::ucs2char_to_hexstr(const char* in, size_t in_length, char* out, size_t out_size)
 {
-    size_t i;
-    size_t x;
-    char buf[] = "  ";
-
     if (out_size - 1 < in_length * 2)
     {
 	return -1;
     }
 
-    for(i = 0, x = 0; i < in_length; i++)
-    {
-	snprintf(buf,sizeof (buf),"%.2X", in[i]);
-	memmove(out + x, buf, 2);
-	x = x + 2;
-    }
+    char* end = bin2hex(out, (const unsigned char*)in, in_length);
+    *end = '\0';
 
-    out[x] = '\0';
-
-    return x;
+    return end - out;
 }
 
 ssize_t CardDevice::hexstr_ucs2_to_utf8(const char* in, size_t in_length, char* out, size_t out_size)
@@ -154,92 +133,47 @@ ssize_t CardDevice::utf8_to_hexstr_ucs2(const char* in, size_t in_length, char*
 
 ssize_t CardDevice::char_to_hexstr_7bit(const char* in, size_t in_length, char* out, size_t out_size)
 {
-    size_t i;
-    size_t x;
-    size_t s;
-    unsigned char c;
-    unsigned char b;
-    unsigned char buf[] = { 0x0, 0x0, 0x0 };
-
-    x = (in_length - in_length / 8) * 2;
-    if(out_size - 1 < x)
+    unsigned char septets[in_length * 2 + 1];
+    int count = utf8_to_gsm(septets, sizeof(septets), in, in_length);
+    if (count < 0)
     {
 	return -1;
     }
 
-    in_length--;
-    for(i = 0, x = 0, s = 0; i < in_length; i++)
+    size_t octets = (count * 7 + 7) / 8;
+    if(out_size - 1 < octets * 2)
     {
-	if(s == 7)
-	{
-	    s = 0;
-	    continue;
-	}
-
-	c = in[i] >> s;
-	b = in[i + 1] << (7 - s);
-	c = c | b;
-	s++;
-
-	snprintf((char*)buf, sizeof(buf), "%.2X", c);
-
-	memmove(out + x, buf, 2);
-	x = x + 2;
+	return -1;
     }
 
-    c = in[i] >> s;
-    snprintf((char*)buf, sizeof(buf), "%.2X", c);
-    memmove(out + x, buf, 2);
-    x = x + 2;
-
-    out[x] = '\0';
+    unsigned char buf[octets + 1];
+    gsm_pack(buf, septets, count);
+    char* end = bin2hex(out, buf, octets);
+    *end = '\0';
 
-    return x;
+    return end - out;
 }
 
 ssize_t CardDevice::hexstr_7bit_to_char (const char* in, size_t in_length, char* out, size_t out_size)
 {
-    size_t i;
-    size_t x;
-    size_t s;
-    int hexval;
-    unsigned char c;
-    unsigned char b;
-    unsigned char buf[] = { 0x0, 0x0, 0x0 };
-
     in_length = in_length / 2;
-    x = in_length + in_length / 7;
-    if(out_size - 1 < x)
+
+    unsigned char buf[in_length + 1];
+    if (hex2bin(buf, in, in_length * 2) < 0)
     {
 	return -1;
     }
 
-    for(i = 0, x = 0, s = 1, b = 0; i < in_length; i++)
+    size_t count = in_length * 8 / 7;
+    unsigned char septets[count + 1];
+    gsm_unpack(septets, buf, count);
+    // 7 spare bits at the end hold CR or zero padding, not a character
+    if (count && in_length % 7 == 0 && (septets[count - 1] == '\r' || !septets[count - 1]))
     {
-	memmove(buf, in + i * 2, 2);
-	if(sscanf((char*)buf, "%x", &hexval) != 1)
-	{
-	    return -1;
-	}
-
-	c = ((unsigned char) hexval) << s;
-	c = (c >> 1) | b;
-	b = ((unsigned char) hexval) >> (8 - s);
-
-	out[x] = c;
-	x++; s++;
-
-	if (s == 8)
-	{
-	    out[x] = b;
-	    s = 1; b = 0;
-	    x++;
-	}
+	count--;
     }
 
-    out[x] = '\0';
-
-    return x;
+    return gsm_to_utf8(out, out_size, septets, count);
 }
 
 /* vi: set ts=8 sw=4 sts=4 noet: */
@@ -46,11 +46,20 @@ static TokenDict dict_errors[] = {
 };
 
 
+static TokenDict dict_policies[] = {
+    { "roundrobin", DeviceGroup::RoundRobin },
+    { "leastrecent", DeviceGroup::LeastRecent },
+    { "bestsignal", DeviceGroup::BestSignal },
+    {  0,   0 },
+};
+
+
 static Configuration s_cfg;
 
 //TODO: make configurable for devices
 static bool s_inband_dtmf = false;
 static bool s_device_monitor = false;
+static int s_group_policy = DeviceGroup::RoundRobin;
 
 
 class YDevEndPoint : public DevicesEndPoint
@@ -75,7 +84,8 @@ public:
 	Engine::enqueue(mu);
     }
 
-    virtual void onReceiveSMS(CardDevice* dev, const String& caller, const String& udh_data, const String& sms)
+    virtual void onReceiveSMS(CardDevice* dev, const String& caller, const String& udh_data, const String& sms,
+	unsigned int parts, bool partial)
     {
 	Debug(DebugAll, "onReceiveSMS Got SMS from %s: '%s'\n", caller.c_str(), sms.c_str());
 	Message* m = new Message("datacard.sms");
@@ -84,11 +94,30 @@ public:
 	m->addParam("caller",caller);
 	if(!udh_data.null())
 	    m->addParam("udh_data", udh_data);
+	if(parts > 1)
+	    m->addParam("parts",String(parts));
+	if(partial)
+	    m->addParam("partial","true");
 	m->addParam("text",sms);
 	dev->getParams(m);
 	Engine::enqueue(m);
     }
 
+    virtual void onSendSMS(CardDevice* dev, const String& called, const String& id, bool sent, unsigned int parts)
+    {
+	Debug(DebugAll, "onSendSMS SMS to %s %s in %u parts\n", called.c_str(), sent ? "sent" : "failed", parts);
+	Message* m = new Message("datacard.sms");
+	m->addParam("type","result");
+	m->addParam("module","datacard");
+	m->addParam("called",called);
+	if(!id.null())
+	    m->addParam("id",id);
+	m->addParam("status",sent ? "sent" : "failed");
+	m->addParam("parts",String(parts));
+	dev->getParams(m);
+	Engine::enqueue(m);
+    }
+
     virtual void onUpdateNetworkStatus(CardDevice* dev)
     {
 	if(!s_device_monitor)
@@ -194,7 +223,7 @@ bool SMSHandler::received(Message &msg)
 	return false;
     String called(msg.getValue("called"));
     String text(msg.getValue("text"));
-    return m_ep->sendSMS(dev, called, text);
+    return m_ep->sendSMS(dev, called, text, msg.getValue("id"));
 }
 
 bool USSDHandler::received(Message &msg)
@@ -296,21 +325,48 @@ bool DatacardDriver::msgExecute(Message& msg, String& dest)
 	return false;
     }
 
-    CardDevice* dev = m_endpoint->findDevice(msg.getValue("device"));
-
-    if (!dev)
-	dev = m_endpoint->findDevice(msg);
+    CardDevice* dev = 0;
+    String number = dest;
 
-    if (!dev)
+    // datacard/group:<name>/<number> picks a free device of the group
+    if (dest.startsWith("group:"))
     {
-	Debug(this,DebugWarn,"Device not found");
-	return false;
+	int pos = dest.find('/');
+	if (pos <= 6 || pos + 1 >= (int)dest.length())
+	{
+	    Debug(this,DebugWarn,"Invalid group target '%s'",dest.c_str());
+	    return false;
+	}
+	String group = dest.substr(6, pos - 6);
+	number = dest.substr(pos + 1);
+	int policy = lookup(msg.getValue("policy"), dict_policies, s_group_policy);
+	dev = m_endpoint->selectDevice(group, (DeviceGroup::Policy)policy);
+	if (!dev)
+	{
+	    Debug(this,DebugWarn,"No free device in group '%s'",group.c_str());
+	    msg.setParam("error","busy");
+	    return false;
+	}
     }
-
-    if(dev->isBusy())
+    else
     {
-	Debug(this,DebugWarn,"Device is busy");
-	return false;
+	dev = m_endpoint->findDevice(msg.getValue("device"));
+
+	if (!dev)
+	    dev = m_endpoint->findDevice(msg);
+
+	if (!dev)
+	{
+	    Debug(this,DebugWarn,"Device not found");
+	    return false;
+	}
+
+	// Reserve like a group pick does, or both calls could take the device
+	if(!dev->reserve(false))
+	{
+	    Debug(this,DebugWarn,"Device is busy");
+	    return false;
+	}
     }
 
     int callingpres = msg.getIntValue("callingpres", -1);
@@ -320,7 +376,10 @@ bool DatacardDriver::msgExecute(Message& msg, String& dest)
     chan->initChan();
 
     CallEndpoint* ch = static_cast<CallEndpoint*>(msg.userData());
-    if (ch && chan->connect(ch,msg.getValue(YSTRING("reason"))) && dev->newCall(dest, callingpres))
+    bool ok = ch && chan->connect(ch,msg.getValue(YSTRING("reason"))) && dev->newCall(number, callingpres);
+    // Either the call is outgoing now or the device is free for others
+    dev->release();
+    if (ok)
     {
 	chan->callConnect(msg);
 	msg.setParam("peerid",chan->id());
@@ -355,6 +414,7 @@ void DatacardDriver::doComplete(const String& partLine, const String& partWord,
     if (partLine == m_statusCmd)
     {
 	Module::itemComplete(rval,"devices",partWord);
+	Module::itemComplete(rval,"stats",partWord);
     }
     lock.drop();
 }
@@ -401,6 +461,10 @@ bool DatacardDriver::received(Message& msg, int id)
 	{
 	    detail = m_endpoint->devicesStatus();
 	}
+	else if(target == "stats")
+	{
+	    detail = m_endpoint->devicesStats();
+	}
 	msg.retValue().clear();
 	msg.retValue() << "module=" << name();
 	msg.retValue() << "," << target;
@@ -467,11 +531,23 @@ void DatacardDriver::initialize()
 
     s_inband_dtmf = s_cfg.getBoolValue("general","inband_dtmf",false);
     s_device_monitor = s_cfg.getBoolValue("general","device_monitor",false);
+    s_group_policy = lookup(s_cfg.getValue("general","group_policy"), dict_policies, DeviceGroup::RoundRobin);
     
     if(first)
+    {
 	m_endpoint = new YDevEndPoint(discovery_interval);
+	m_endpoint->loadBudgets(s_cfg.getValue("general","budget_file",Engine::configFile("datacard-budget")));
+	m_endpoint->setupHotplug(s_cfg.getBoolValue("general","hotplug",true));
+    }
     else
 	m_endpoint->cleanDevices();
+    m_endpoint->setupReassembly(
+	s_cfg.getIntValue("general","sms_reassembly_timeout",DEF_SMS_REASSEMBLY_TIMEOUT),
+	s_cfg.getIntValue("general","sms_reassembly_memory",DEF_SMS_REASSEMBLY_MEMORY));
+
+    int reactors = s_cfg.getIntValue("general","reactor_threads",0);
+    if(first && reactors > 0)
+	Output("AT reactor threads %u", m_endpoint->startReactors(reactors));
     String name;
     unsigned int n = s_cfg.sections();
     for (unsigned int i = 0; i < n; i++) 
@@ -485,6 +561,11 @@ void DatacardDriver::initialize()
 	m_endpoint->appendDevice(name, sect);
     }
 
+    int media = s_cfg.getIntValue("general","media_threads",0);
+    if(first && media > 0)
+	Output("Media threads %u", m_endpoint->startMediaReactors(media,
+	    s_cfg.getBoolValue("general","media_affinity",false)));
+
     if(first)
     {
 	m_endpoint->startup();
@@ -25,6 +25,10 @@
 #include <stdlib.h>
 #include <poll.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 #include "pdu.h"
 
 
@@ -48,6 +52,7 @@ static int opentty (char* dev)
     if (tcgetattr (fd, &term_attr) != 0)
     {
 	Debug("opentty",DebugAll, "tcgetattr() failed '%s'", dev);
+	close(fd);
 	return -1;
     }
 
@@ -79,6 +84,13 @@ static int opentty (char* dev)
     return fd;
 }
 
+// Reactor threads serve many devices, a tty of one must never block them
+static bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
 MonitorThread::MonitorThread(CardDevice* dev):m_device(dev) {}
 
 MonitorThread::~MonitorThread() {}
@@ -99,28 +111,24 @@ MediaThread::~MediaThread() {}
 void MediaThread::run()
 {
     struct pollfd pfd;
-    char buf[1024];
-    int len;
-    char silence_frame[FRAME_SIZE];
+    char buf[FRAME_SIZE];
 
     ssize_t res;
 
-    memset(silence_frame, 0, sizeof(silence_frame));
-
     if (!m_device)
         return;
 
-    m_device->m_audio_buf.clear();
+    m_device->m_jitter.flush();
 
     // Main loop
     while (m_device->isRunning())
     {
-	m_device->m_mutex.lock();
+	m_device->m_media_mutex.lock();
 
 	pfd.fd = m_device->m_audio_fd;
 	pfd.events = POLLIN;
 
-	m_device->m_mutex.unlock();
+	m_device->m_media_mutex.unlock();
 
 	res = poll(&pfd, 1, 1000);
 
@@ -133,38 +141,12 @@ void MediaThread::run()
 	    return;
 	}
 
-	if (res == 0)
+	if (res <= 0)
 	    continue;
 
 	if(pfd.revents & POLLIN) 
 	{
-	    m_device->m_mutex.lock();
-
-	    len = read(pfd.fd, buf, FRAME_SIZE);
-	    if(len)
-		m_device->forwardAudio(buf, len);
-
-//TODO: Write full data
-	    unsigned int avail = m_device->m_audio_buf.length();	
-	    if(avail >= FRAME_SIZE)
-	    {
-		char* data = (char*)m_device->m_audio_buf.data();
-		write(pfd.fd, data, FRAME_SIZE);
-		m_device->m_audio_buf.cut(-FRAME_SIZE);
-	    }
-	    else if(avail > 0)
-	    {
-		Debug(DebugAll, "[%s] write truncated frame", m_device->c_str());
-		char* data = (char*)m_device->m_audio_buf.data();
-		write(pfd.fd, data, avail);
-		m_device->m_audio_buf.cut(-avail);
-	    }
-	    else
-	    {
-		Debug(DebugAll, "[%s] write silence", m_device->c_str());
-		write(pfd.fd, silence_frame, FRAME_SIZE);
-	    }
-	    m_device->m_mutex.unlock();
+	    m_device->processAudio(buf);
 	}
 	else if(pfd.revents)
 	{
@@ -196,7 +178,7 @@ unsigned long DatacardConsumer::Consume(const DataBlock& data, unsigned long tSt
 {
     if (!m_device)
 	return invalidStamp();
-    m_device->sendAudio((char*)data.data(), data.length());
+    m_device->sendAudio((char*)data.data(), data.length(), tStamp);
     return 0;
 }
 
@@ -209,13 +191,40 @@ DatacardSource::~DatacardSource()
 }
 
 
-CardDevice::CardDevice(String name, DevicesEndPoint* ep):String(name), m_endpoint(ep), m_monitor(0), m_consumer(0), m_source(0), m_mutex(true), m_conn(0), m_connected(false)
+CardDevice::CardDevice(String name, DevicesEndPoint* ep):String(name), m_endpoint(ep), m_monitor(0), m_reactor(0), m_media(0), m_media_reactor(0), m_consumer(0), m_source(0), m_mutex(true), m_media_mutex(false), m_conn(0), m_connected(false)
 {
     m_data_fd = -1;
     m_audio_fd = -1;
     m_incoming_pdu = false;
 
-    m_state = BLT_STATE_WANT_CONTROL;
+    m_rx_frame.assign(0, FRAME_SIZE);
+    m_tx_drops = 0;
+    m_rx_stamp = 0;
+
+    m_rd_buff_pos = 0;
+    m_wr_buff_len = 0;
+    m_rd_reads = 0;
+    m_rd_lines = 0;
+    m_at_activity = 0;
+    m_at_events = 0;
+    m_at_pipelined = 0;
+    m_at_timeouts = 0;
+    m_at_retries = 0;
+    m_sms_ref = 0;
+    m_sms_tat = 0;
+    m_sms_parts = 0;
+    m_sms_errors = 0;
+    m_pipeline = false;
+    m_sms_ref16 = false;
+    m_sms_rate = 0;
+    m_sms_burst = 1;
+    m_sms_retries = DEF_SMS_RETRIES;
+    m_sms_spool_max = DEF_SMS_SPOOL;
+    m_last_call = 0;
+    m_reserved = 0;
+    m_budget = 0;
+    m_call_budget = 0;
+    m_sms_budget = 0;
 
     m_cusd_use_ucs2_decoding = 1;
     m_gsm_reg_status = -1;
@@ -243,6 +252,9 @@ CardDevice::CardDevice(String name, DevicesEndPoint* ep):String(name), m_endpoin
 
     m_simstatus = -1;
     m_pincount = 0;
+    m_cpms = -1;
+    m_sms_drain = false;
+    m_sms_listed = 0;
     m_commandQueue.clear();
     m_lastcmd = 0;
 
@@ -252,16 +264,52 @@ CardDevice::CardDevice(String name, DevicesEndPoint* ep):String(name), m_endpoin
 
 CardDevice::~CardDevice()
 {
+    // Outgoing SMS still spooled report their failure while the device is whole
+    m_commandQueue.clear();
+    m_pipelined.clear();
+    TelEngine::destruct(m_lastcmd);
+    for (ObjList* l = m_sms_spool.skipNull(); l; l = l->skipNext())
+	static_cast<OutgoingSMS*>(l->get())->abort();
+    m_sms_spool.clear();
     TelEngine::destruct(m_source);
     TelEngine::destruct(m_consumer);
 }
 
+bool CardDevice::startMedia()
+{
+    m_media_reactor = m_endpoint->mediaReactor();
+    if (m_media_reactor)
+    {
+	m_jitter.flush();
+	if (setNonBlocking(m_audio_fd) && m_media_reactor->attach(this))
+	    return true;
+	m_media_reactor = 0;
+	return false;
+    }
+    m_media = new MediaThread(this);
+    return m_media->startup();
+}
+
 bool CardDevice::startMonitor() 
 {
     m_running = true;
-    m_media = new MediaThread(this);
+    m_reactor = m_endpoint->reactor();
+    if (m_reactor)
+    {
+	atStart();
+	if (!setNonBlocking(m_data_fd) || !m_reactor->attach(this))
+	{
+	    m_reactor = 0;
+	    return false;
+	}
+	if (startMedia())
+	    return true;
+	m_reactor->detach(this);
+	m_reactor = 0;
+	return false;
+    }
     m_monitor = new MonitorThread(this);
-    return m_monitor->startup() && m_media->startup();
+    return m_monitor->startup() && startMedia();
 }
 
 bool CardDevice::tryConnect()
@@ -270,12 +318,20 @@ bool CardDevice::tryConnect()
     if(!m_connected)
     {
 	Debug("tryConnect",DebugAll,"Datacard %s trying to connect on %s...", safe(), m_data_tty.safe());
-	if(((m_data_fd = opentty((char*)m_data_tty.safe())) > -1) && ((m_audio_fd = opentty((char*)m_audio_tty.safe())) > -1))
-	    if(startMonitor())
+	if((m_data_fd = opentty((char*)m_data_tty.safe())) > -1)
+	{
+	    // Hot plug may see the data tty before the audio one is usable
+	    if((m_audio_fd = opentty((char*)m_audio_tty.safe())) < 0)
+	    {
+		close(m_data_fd);
+		m_data_fd = -1;
+	    }
+	    else if(startMonitor())
 	    {
 	        m_connected = true;
 	        Debug("tryConnect",DebugAll,"Datacard %s has connected, initializing...", safe());
 	    }
+	}
     }
     m_mutex.unlock();
     return m_connected;
@@ -298,11 +354,24 @@ bool CardDevice::disconnect()
 	Hangup(DATACARD_FAILURE);
     }
 
-    close(m_data_fd);
-    close(m_audio_fd);
+    if (m_reactor)
+    {
+	m_reactor->detach(this);
+	m_reactor = 0;
+    }
+    if (m_media_reactor)
+    {
+	m_media_reactor->detach(this);
+	m_media_reactor = 0;
+    }
 
+    close(m_data_fd);
     m_data_fd = -1;
+
+    m_media_mutex.lock();
+    close(m_audio_fd);
     m_audio_fd = -1;
+    m_media_mutex.unlock();
 
     m_connected	= false;
     m_initialized = 0;
@@ -320,16 +389,20 @@ bool CardDevice::disconnect()
     m_firmware.clear();
     m_imei.clear();
     m_imsi.clear();
+    m_endpoint->indexDevice(this);
 
     m_provider_name = "NONE";
     m_number = "Unknown";
     m_incoming_pdu = false;
+    m_cpms = -1;
+    m_sms_drain = false;
 
     m_simstatus = -1;
     m_pincount = 0;
 
     m_commandQueue.clear();
-    m_lastcmd = 0;
+    m_pipelined.clear();
+    TelEngine::destruct(m_lastcmd);
 
     m_initialized = 0;
 
@@ -470,51 +543,251 @@ String CardDevice::getStatus()
     return ret;
 }
 
+String CardDevice::getStats()
+{
+    Lock lock(m_mutex);
+    String ret = c_str();
+    ret << "|rdreads=" << m_rd_reads;
+    ret << ",rdlines=" << m_rd_lines;
+    ret << ",atpipelined=" << m_at_pipelined;
+    ret << ",attimeouts=" << m_at_timeouts;
+    ret << ",atretries=" << m_at_retries;
+    m_commandQueue.stats(ret);
+    ret << ",smsspool=" << m_sms_spool.count();
+    ret << ",smsparts=" << m_sms_parts;
+    ret << ",smserrors=" << m_sms_errors;
+    if (m_budget)
+    {
+	ret << ",callseconds=" << m_budget->m_callSeconds;
+	ret << ",smstoday=" << m_budget->m_sms;
+    }
+    ret << ",audiooverflows=" << m_jitter.m_ring.m_overflows;
+    ret << ",audiounderruns=" << m_jitter.m_underruns;
+    ret << ",audiodrops=" << m_tx_drops;
+    ret << ",audiolate=" << m_jitter.m_late;
+    ret << ",audioconcealed=" << m_jitter.m_concealed;
+    ret << ",audiodropped=" << m_jitter.m_dropped;
+    ret << ",jitterdelay=" << m_jitter.delay();
+    return ret;
+}
+
 
 // SMS and USSD
-bool CardDevice::sendSMS(const String &called, const String &sms)
+OutgoingSMS::OutgoingSMS(DevicesEndPoint* ep, CardDevice* dev, const String& called, const String& id,
+    unsigned int parts, unsigned int retries)
+    : m_endpoint(ep), m_device(dev), m_called(called), m_id(id),
+    m_parts(parts), m_next(0), m_retries(retries), m_left(retries), m_retryAt(0),
+    m_busy(false), m_failed(false)
+{
+    m_pdu = new String[parts];
+    m_len = new int[parts];
+}
+
+OutgoingSMS::~OutgoingSMS()
+{
+    delete[] m_pdu;
+    delete[] m_len;
+}
+
+void OutgoingSMS::setPart(unsigned int part, const char* pdu, int len)
+{
+    m_pdu[part] = pdu;
+    m_len[part] = len;
+}
+
+ATCommand* OutgoingSMS::command()
+{
+    m_busy = true;
+    return new SMSCommand("AT+CMGS=" + String(m_len[m_next]), m_pdu[m_next], this);
+}
+
+void OutgoingSMS::partDone(bool sent)
+{
+    m_busy = false;
+    if (sent)
+    {
+	m_next++;
+	m_left = m_retries;
+	// The PDU is not needed any more
+	m_pdu[m_next - 1].clear();
+    }
+    else if (m_left)
+    {
+	m_left--;
+	m_retryAt = Time::msecNow() + DC_SMS_RETRY_DELAY;
+	Debug(DebugAll, "[%s] SMS part %u to %s refused, %u retries left", m_device->c_str(),
+	    m_next + 1, m_called.c_str(), m_left);
+	return;
+    }
+    else
+	m_failed = true;
+    if (done())
+	m_endpoint->onSendSMS(m_device, m_called, m_id, !m_failed, m_parts);
+}
+
+void OutgoingSMS::abort()
+{
+    if (done())
+	return;
+    m_failed = true;
+    m_endpoint->onSendSMS(m_device, m_called, m_id, false, m_parts);
+}
+
+SMSCommand::SMSCommand(const String& command, const char* pdu, OutgoingSMS* sms)
+    : ATCommand(command, CMD_AT_CMGS, new String(pdu)), m_sms(sms), m_done(false)
+{
+    m_sms->ref();
+}
+
+SMSCommand::~SMSCommand()
+{
+    // Dropped from the queue on disconnect
+    if (!m_done)
+	m_sms->interrupted();
+    TelEngine::destruct(m_sms);
+}
+
+void SMSCommand::sent()
+{
+    if (m_done)
+	return;
+    m_done = true;
+    m_sms->partDone(true);
+}
+
+void SMSCommand::failed()
+{
+    if (m_done)
+	return;
+    m_done = true;
+    m_sms->partDone(false);
+}
+
+bool CardDevice::sendSMS(const String &called, const String &sms, const String &id)
 {
     Debug(DebugAll, "[%s] sendSMS: %s", c_str(), sms.c_str());
 
     Lock lock(m_mutex);
 
     // TODO: Check called & sms
-    // Check if msg will be desrtoyed
 
-    if (m_connected && m_initialized && m_gsm_registered)
+    // Spooled messages wait for the device to (re)connect, unless it is known not to handle SMS
+    if ((m_initialized && !m_has_sms) || m_disablesms)
     {
-	if(m_has_sms)
-	{
-	    PDU pdu;
-	    pdu.setMessage(sms.safe());
-	    pdu.setNumber(called.safe());
-	    pdu.setAlphabet(PDU::UCS2);
-	    pdu.generate();
-
-	    const char* pdutext = pdu.getPDU();
-	    m_commandQueue.append(new ATCommand("AT+CMGS=" + String(pdu.getMessageLen()), CMD_AT_CMGS, new String(pdutext)));
-	}
-	else
-	{
-	    Debug(DebugAll, "Datacard %s doesn't handle SMS -- SMS will not be sent", c_str());
-	    return false;
-	}
+	Debug(DebugAll, "Datacard %s doesn't handle SMS -- SMS will not be sent", c_str());
+	return false;
     }
-    else
+    if (m_sms_spool.count() >= m_sms_spool_max)
     {
-	Debug(DebugAll, "Device %s not connected / initialized / registered", c_str());
+	Debug(DebugMild, "[%s] SMS spool full with %u messages -- SMS will not be sent", c_str(), m_sms_spool_max);
 	return false;
     }
+
+    // Text the GSM alphabet covers goes 7 bit, 160 characters per SMS
+    PDU::Alphabet alphabet = (utf8_gsm_septets(sms.c_str(), sms.length()) >= 0) ? PDU::GSM : PDU::UCS2;
+    int parts[DC_SMS_PARTS_MAX];
+    int count = PDU::split(sms.safe(), sms.length(), alphabet, m_sms_ref16, parts, DC_SMS_PARTS_MAX);
+    if (!count)
+    {
+	Debug(DebugAll, "[%s] SMS needs more than %d parts -- SMS will not be sent", c_str(), DC_SMS_PARTS_MAX);
+	return false;
+    }
+    int ref = 0;
+    if (count > 1)
+    {
+	m_sms_ref = (m_sms_ref + 1) & (m_sms_ref16 ? 0xffff : 0xff);
+	ref = m_sms_ref;
+	Debug(DebugAll, "[%s] Sending SMS in %d parts, reference %d", c_str(), count, ref);
+    }
+
+    // Encode all parts now, the spool sends them one by one
+    OutgoingSMS* out = new OutgoingSMS(m_endpoint, this, called, id, count, m_sms_retries);
+    const char* text = sms.safe();
+    for (int i = 0; i < count; i++)
+    {
+	PDU pdu;
+	pdu.setMessage(text, parts[i]);
+	pdu.setNumber(called.safe());
+	pdu.setAlphabet(alphabet);
+	if (count > 1)
+	    pdu.setConcat(ref, count, i + 1, m_sms_ref16);
+	pdu.generate();
+	text += parts[i];
+	out->setPart(i, pdu.getPDU(), pdu.getMessageLen());
+    }
+    m_sms_spool.append(out);
+    smsPump();
+    return true;
+}
+
+bool CardDevice::reserve(bool group)
+{
+    Lock lock(m_mutex);
+    u_int64_t now = Time::msecNow();
+    if (group ? !isFree(now) : isBusy())
+	return false;
+    m_reserved = now;
+    m_last_call = now;
     return true;
 }
 
+void CardDevice::release()
+{
+    Lock lock(m_mutex);
+    m_reserved = 0;
+}
+
+void CardDevice::smsPump()
+{
+    Lock lock(m_mutex);
+
+    // Reported messages leave the spool
+    OutgoingSMS* out;
+    while ((out = static_cast<OutgoingSMS*>(m_sms_spool.get())) && out->done())
+	m_sms_spool.remove(out);
+    if (!out)
+	return;
+    if (m_initialized && !m_has_sms)
+    {
+	for (ObjList* l = m_sms_spool.skipNull(); l; l = l->skipNext())
+	    static_cast<OutgoingSMS*>(l->get())->abort();
+	m_sms_spool.clear();
+	return;
+    }
+    if (!(m_connected && m_initialized && m_gsm_registered))
+	return;
+    u_int64_t now = Time::msecNow();
+    if (!out->ready(now))
+	return;
+    // Out of budget for today, the spool waits for the next day
+    if (!smsBudgetLeft())
+	return;
+
+    // Token bucket kept as the time it is paid up to: every part adds an
+    // interval, up to burst parts may go ahead of time
+    if (m_sms_rate)
+    {
+	u_int64_t interval = 60000 / m_sms_rate;
+	if (m_sms_tat < now)
+	    m_sms_tat = now;
+	if (m_sms_tat > now + (m_sms_burst - 1) * interval)
+	    return;
+	m_sms_tat += interval;
+    }
+    queueCommand(out->command());
+}
+
 bool CardDevice::receiveSMS(const char* pdustr, size_t len)
 {
     PDU pdu(pdustr);
     if (!pdu.parse())
 	return false;
 
-    m_endpoint->onReceiveSMS(this, String(pdu.getNumber()), String(pdu.getUDHData()), String(pdu.getMessage()));
+    int ref, parts, part;
+    if (pdu.getConcat(ref, parts, part) && parts > 1)
+	m_endpoint->reassembleSMS(this, String(pdu.getNumber()), ref, parts, part, String(pdu.getMessage()));
+    else
+	m_endpoint->onReceiveSMS(this, String(pdu.getNumber()), String(pdu.getUDHData()), String(pdu.getMessage()));
     return true;
 }
 
@@ -529,7 +802,7 @@ bool CardDevice::sendUSSD(const String &ussd)
 	String ussdenc;
 	if(!encodeUSSD(ussd, ussdenc))
 	    return false;
-	m_commandQueue.append(new ATCommand("AT+CUSD=1,\"" + ussdenc + "\",15", CMD_AT_CUSD));
+	queueCommand(new ATCommand("AT+CUSD=1,\"" + ussdenc + "\",15", CMD_AT_CUSD));
     }
     else
     {
@@ -551,9 +824,7 @@ bool CardDevice::incomingCall(const String &caller)
 	Debug(DebugAll, "CardDevice::incomingCall error: m_conn is NULL");
 	return false;
     }
-    m_mutex.lock();
-    m_audio_buf.clear();
-    m_mutex.unlock();
+    m_jitter.flush();
     return m_conn->onIncoming(caller);
 }
 
@@ -570,7 +841,7 @@ bool CardDevice::Hangup(int reason)
 //TODO: Review this!!!
     if(m_needchup)
     {
-	m_commandQueue.append(new ATCommand("AT+CHUP", CMD_AT_CHUP));
+	queueCommand(new ATCommand("AT+CHUP", CMD_AT_CHUP));
 	m_needchup = 0;
     }
     lock.drop();
@@ -608,11 +879,11 @@ bool CardDevice::newCall(const String &called, int callingpres)
 	pres_tmp = callingpres;
 
     if((pres_tmp >= 0) && (pres_tmp <= 2))
-	m_commandQueue.append(new ATCommand("AT+CLIR=" + String(pres_tmp), CMD_AT_CLIR, new String(called)));
+	queueCommand(new ATCommand("AT+CLIR=" + String(pres_tmp), CMD_AT_CLIR, new String(called)));
     else
-        m_commandQueue.append(new ATCommand("ATD" + called + ";", CMD_AT_D));
+        queueCommand(new ATCommand("ATD" + called + ";", CMD_AT_D));
 
-    m_audio_buf.clear();
+    m_jitter.flush();
 
     m_outgoing = 1;
     m_needchup = 1;
@@ -800,23 +1071,145 @@ bool CardDevice::encodeUSSD(const String& code, String& ret)
 }
 
 //audio
+void CardDevice::processAudio(char* buf)
+{
+    Lock lock(m_media_mutex);
+    if (m_audio_fd < 0)
+	return;
+
+    char* frame = (char*)m_rx_frame.data();
+    int len = read(m_audio_fd, frame, FRAME_SIZE);
+    if(len > 0)
+	forwardAudio(frame, len);
+
+    // Modem expects a frame for every frame it sends, pad with silence
+    unsigned int avail = m_jitter.get(buf);
+    if (avail < FRAME_SIZE)
+	memset(buf + avail, 0, FRAME_SIZE - avail);
+    // Pooled audio ttys are non blocking, one that stops draining loses
+    //  frames instead of stalling the other devices of the thread
+    if (write(m_audio_fd, buf, FRAME_SIZE) != FRAME_SIZE)
+	m_tx_drops++;
+}
+
 void CardDevice::forwardAudio(char* data, int len)
 {
-    if(m_source && m_source->valid())
-	m_source->Forward(DataBlock(data, len));
+    unsigned long stamp = m_rx_stamp;
+    m_rx_stamp += len / 2;
+    if(!m_source || !m_source->valid())
+	return;
+
+    // Consumers copy what they keep, so one block per device is recycled
+    if (len == FRAME_SIZE)
+    {
+	if (data != m_rx_frame.data())
+	    ::memcpy(m_rx_frame.data(), data, FRAME_SIZE);
+	m_source->Forward(m_rx_frame, stamp);
+    }
+    else
+	m_source->Forward(DataBlock(data, len), stamp);
 }
 
-int CardDevice::sendAudio(char* data, int len)
+int CardDevice::sendAudio(char* data, int len, unsigned long tStamp)
 {
-//TODO:
-    m_mutex.lock();
-    m_audio_buf.append(data, len);
-    m_mutex.unlock();
-    return 0;
+    if (len <= 0)
+	return 0;
+    return m_jitter.put(data, len, tStamp);
+}
+
+//Incoming concatenated SMS
+SMSParts::SMSParts(const String& key, CardDevice* dev, const String& caller, unsigned int parts, u_int64_t expires)
+    : String(key), m_device(dev), m_caller(caller), m_parts(parts), m_received(0), m_bytes(0),
+    m_expires(expires)
+{
+    m_text = new String[parts];
+    ::memset(m_got, 0, sizeof(m_got));
+}
+
+SMSParts::~SMSParts()
+{
+    delete[] m_text;
+}
+
+unsigned int SMSParts::add(unsigned int part, const String& text)
+{
+    part--;
+    if (part >= m_parts || (m_got[part >> 3] & (1 << (part & 7))))
+	return 0;
+    m_got[part >> 3] |= 1 << (part & 7);
+    m_text[part] = text;
+    m_received++;
+    // An empty part still takes a slot
+    unsigned int bytes = text.length() + 1;
+    m_bytes += bytes;
+    return bytes;
+}
+
+String SMSParts::text() const
+{
+    String text;
+    for (unsigned int i = 0; i < m_parts; i++)
+	text += m_text[i];
+    return text;
+}
+
+//Device groups
+DeviceGroup::DeviceGroup(const String& name)
+    : String(name), m_members(0), m_count(0), m_alloc(0), m_next(0)
+{
+}
+
+DeviceGroup::~DeviceGroup()
+{
+    delete[] m_members;
+}
+
+void DeviceGroup::append(CardDevice* dev)
+{
+    if (m_count == m_alloc)
+    {
+	m_alloc = m_alloc ? 2 * m_alloc : 8;
+	CardDevice** members = new CardDevice*[m_alloc];
+	for (unsigned int i = 0; i < m_count; i++)
+	    members[i] = m_members[i];
+	delete[] m_members;
+	m_members = members;
+    }
+    m_members[m_count++] = dev;
+}
+
+CardDevice* DeviceGroup::pick(Policy policy, u_int64_t now)
+{
+    CardDevice* best = 0;
+    unsigned int start = m_next;
+    for (unsigned int i = 0; i < m_count; i++)
+    {
+	unsigned int n = (start + i) % m_count;
+	CardDevice* dev = m_members[n];
+	if (!dev->isFree(now))
+	    continue;
+	if (policy == RoundRobin)
+	{
+	    // A concurrent pick that moved the cursor first keeps its position
+	    __sync_bool_compare_and_swap(&m_next, start, n + 1);
+	    return dev;
+	}
+	if (!best || (policy == LeastRecent && dev->m_last_call < best->m_last_call)
+	    || (policy == BestSignal && dev->signal() > best->signal()))
+	    best = dev;
+    }
+    return best;
 }
 
 //EndPoint
-DevicesEndPoint::DevicesEndPoint(int interval):Thread("DeviceEndPoint"),m_mutex(true),m_interval(interval),m_run(true)
+DevicesEndPoint::DevicesEndPoint(int interval):Thread("DeviceEndPoint"),m_mutex(true),m_interval(interval),m_run(true),
+    m_reactors(0),m_reactorCount(0),m_mediaReactors(0),m_mediaReactorCount(0),
+    m_reactorMutex(false),m_reactorsLive(0),
+    m_indexMutex(false),m_byName(DC_DEVICE_HASH),m_byImei(DC_DEVICE_HASH),m_byImsi(DC_DEVICE_HASH),
+    m_budgetMutex(false),m_budgets(DC_DEVICE_HASH),m_budgetDay(0),m_budgetDirty(false),m_budgetSaved(0),
+    m_watchFd(-1),m_rewatch(false),
+    m_smsMutex(false),m_smsBytes(0),m_smsTimeout(DEF_SMS_REASSEMBLY_TIMEOUT * 1000),
+    m_smsMemory(DEF_SMS_REASSEMBLY_MEMORY)
 {
     m_devices.clear();
 }
@@ -824,32 +1217,218 @@ DevicesEndPoint::DevicesEndPoint(int interval):Thread("DeviceEndPoint"),m_mutex(
 DevicesEndPoint::~DevicesEndPoint()
 {
     Debug(DebugAll, "Datacard devices: %d", m_devices.count());
+    // Reactors report to us when they are gone
+    stopReactors();
+    if (m_watchFd > -1)
+	close(m_watchFd);
+}
+
+// Both ttys of a device exist, worth trying to open them
+static bool ttysPresent(const String& data, const String& audio)
+{
+    return !(::access(data.safe(), F_OK) || ::access(audio.safe(), F_OK));
 }
 
 void DevicesEndPoint::run()
 {
-    while(m_run)
+    // Wake every second for the SMS reassembly timeouts, discover less often
+    for (int tick = 0; m_run; tick++)
     {
-	CardDevice* dev = 0;
-	m_mutex.lock();
-        const ObjList *devicesIter = &m_devices;
-	while (devicesIter)
+	if (tick >= m_interval)
+	    tick = 0;
+	if (!tick)
 	{
+	    CardDevice* dev = 0;
+	    m_mutex.lock();
+	    const ObjList *devicesIter = &m_devices;
+	    while (devicesIter)
+	    {
 		GenObject* obj = devicesIter->get();
 		devicesIter = devicesIter->next();
 		if (!obj) continue;
 		dev = static_cast<CardDevice*>(obj);
+		// Watched ttys that are missing get connected when they show up
+		if (m_watchFd > -1 && !(dev->m_connected || ttysPresent(dev->m_data_tty, dev->m_audio_tty)))
+		    continue;
 		dev->tryConnect();
+	    }
+	    m_mutex.unlock();
 	}
-	m_mutex.unlock();
-	
+	flushSMS(false);
+	pumpSMS();
+	checkBudgets();
+
 	if (m_run)
+	    hotplugWait(1000);
+    }
+}
+
+bool DevicesEndPoint::setupHotplug(bool enable)
+{
+    if (!enable)
+	return false;
+    if (m_watchFd < 0)
+    {
+	m_watchFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_watchFd < 0)
 	{
-	    Thread::sleep(m_interval);
-        }
+	    Debug(DebugWarn, "Hot plug unavailable, polling for devices only: %s", strerror(errno));
+	    return false;
+	}
+    }
+    Lock lock(m_mutex);
+    m_rewatch = true;
+    return true;
+}
+
+void DevicesEndPoint::rewatch()
+{
+    ObjList ttys;
+    m_mutex.lock();
+    m_rewatch = false;
+    for (ObjList* l = m_devices.skipNull(); l; l = l->skipNext())
+    {
+	CardDevice* dev = static_cast<CardDevice*>(l->get());
+	ttys.append(new String(dev->m_data_tty));
+	ttys.append(new String(dev->m_audio_tty));
+    }
+    m_mutex.unlock();
+
+    for (ObjList* l = ttys.skipNull(); l; l = l->skipNext())
+    {
+	String dir = *static_cast<String*>(l->get());
+	// Walk up to the closest directory that exists, udev creates the
+	//  by-id and by-path ones with the first device
+	for (int pos = dir.rfind('/'); pos > 0; pos = dir.rfind('/'))
+	{
+	    dir = dir.substr(0, pos);
+	    if (m_watches.find(dir))
+		break;
+	    int wd = ::inotify_add_watch(m_watchFd, dir.c_str(), IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+	    if (wd > -1)
+	    {
+		Debug(DebugAll, "Watching '%s' for device ttys", dir.c_str());
+		m_watches.append(new TtyWatch(dir, wd));
+		break;
+	    }
+	    if (errno != ENOENT)
+	    {
+		Debug(DebugMild, "Cannot watch '%s' for device ttys: %s", dir.c_str(), strerror(errno));
+		break;
+	    }
+	}
     }
 }
 
+void DevicesEndPoint::hotplugWait(unsigned int msec)
+{
+    if (m_watchFd < 0)
+    {
+	Thread::msleep(msec);
+	return;
+    }
+    m_mutex.lock();
+    bool again = m_rewatch;
+    m_mutex.unlock();
+    if (again)
+	rewatch();
+    u_int64_t end = Time::msecNow() + msec;
+    for (u_int64_t now = Time::msecNow(); m_run && now < end; now = Time::msecNow())
+    {
+	struct pollfd pfd;
+	pfd.fd = m_watchFd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	int ret = ::poll(&pfd, 1, (int)(end - now));
+	if (ret > 0)
+	    hotplugEvents();
+	else if (ret < 0 && errno != EINTR)
+	{
+	    Thread::msleep(end - now);
+	    break;
+	}
+    }
+}
+
+void DevicesEndPoint::hotplugEvents()
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ObjList paths;
+    bool all = false;
+    bool again = false;
+    int len;
+    while ((len = ::read(m_watchFd, buf, sizeof(buf))) > 0)
+    {
+	for (int pos = 0; pos < len; )
+	{
+	    const struct inotify_event* ev = (const struct inotify_event*)(buf + pos);
+	    pos += sizeof(struct inotify_event) + ev->len;
+	    // Lost events, check every device
+	    if (ev->mask & IN_Q_OVERFLOW)
+	    {
+		all = true;
+		continue;
+	    }
+	    TtyWatch* watch = 0;
+	    for (ObjList* l = m_watches.skipNull(); l; l = l->skipNext())
+	    {
+		if (static_cast<TtyWatch*>(l->get())->m_wd == ev->wd)
+		{
+		    watch = static_cast<TtyWatch*>(l->get());
+		    break;
+		}
+	    }
+	    if (!watch)
+		continue;
+	    // Directory went away or a new one may hold the ttys
+	    if (ev->mask & IN_IGNORED)
+	    {
+		m_watches.remove(watch);
+		again = true;
+		continue;
+	    }
+	    if (ev->mask & IN_ISDIR)
+	    {
+		again = true;
+		continue;
+	    }
+	    if (!ev->len)
+		continue;
+	    String* path = new String(*watch);
+	    *path << "/" << ev->name;
+	    paths.append(path);
+	}
+    }
+    // Ttys may have shown up in a new directory before it was watched
+    m_mutex.lock();
+    if (again)
+	m_rewatch = true;
+    again = m_rewatch;
+    m_mutex.unlock();
+    if (again)
+    {
+	rewatch();
+	all = true;
+    }
+    if (!(all || paths.skipNull()))
+	return;
+
+    m_mutex.lock();
+    for (ObjList* l = m_devices.skipNull(); l; l = l->skipNext())
+    {
+	CardDevice* dev = static_cast<CardDevice*>(l->get());
+	if (dev->m_connected)
+	    continue;
+	if (!(all || paths.find(dev->m_data_tty) || paths.find(dev->m_audio_tty)))
+	    continue;
+	if (!ttysPresent(dev->m_data_tty, dev->m_audio_tty))
+	    continue;
+	Debug(DebugInfo, "Datacard %s ttys showed up", dev->safe());
+	dev->tryConnect();
+    }
+    m_mutex.unlock();
+}
+
 void DevicesEndPoint::cleanup()
 {
 }
@@ -858,22 +1437,136 @@ void DevicesEndPoint::onReceiveUSSD(CardDevice* dev, String ussd)
 {
 }
 
-void DevicesEndPoint::onReceiveSMS(CardDevice* dev, const String& caller, const String& udh_data, const String& sms)
+void DevicesEndPoint::onReceiveSMS(CardDevice* dev, const String& caller, const String& udh_data, const String& sms,
+    unsigned int parts, bool partial)
+{
+}
+
+void DevicesEndPoint::reassembleSMS(CardDevice* dev, const String& caller, int ref, int parts, int part, const String& sms)
+{
+    String key;
+    key << dev->c_str() << "/" << caller << "/" << ref;
+
+    m_smsMutex.lock();
+    // Skip entries given up on, they only wait for flushSMS() and the key
+    //  may already belong to the next message
+    SMSParts* msg = 0;
+    ObjList* l = m_smsParts.skipNull();
+    for (; l; l = l->skipNext())
+    {
+	SMSParts* p = static_cast<SMSParts*>(l->get());
+	if (p->m_expires && *p == key)
+	{
+	    msg = p;
+	    break;
+	}
+    }
+    if (msg && msg->m_parts != (unsigned int)parts)
+    {
+	// Reference reused for another message, give up on the old one
+	msg->m_expires = 0;
+	msg = 0;
+    }
+    if (!msg)
+    {
+	msg = new SMSParts(key, dev, caller, parts, Time::msecNow() + m_smsTimeout);
+	m_smsParts.append(msg);
+    }
+    unsigned int bytes = msg->add(part, sms);
+    if (!bytes)
+	Debug(DebugAll, "[%s] Dropped repeated part %d/%d of SMS %d from %s", dev->c_str(), part, parts, ref, caller.c_str());
+    m_smsBytes += bytes;
+
+    if (msg->complete())
+    {
+	m_smsParts.remove(msg, false);
+	m_smsBytes -= msg->m_bytes;
+	m_smsMutex.unlock();
+	onReceiveSMS(dev, caller, String::empty(), msg->text(), msg->m_parts);
+	TelEngine::destruct(msg);
+	return;
+    }
+
+    // Over the memory cap hand over the oldest messages as they are
+    if (m_smsBytes > m_smsMemory)
+    {
+	unsigned int keep = m_smsBytes;
+	for (l = m_smsParts.skipNull(); l; l = l->skipNext())
+	    if (!static_cast<SMSParts*>(l->get())->m_expires)
+		keep -= static_cast<SMSParts*>(l->get())->m_bytes;
+	for (l = m_smsParts.skipNull(); l && keep > m_smsMemory; l = l->skipNext())
+	{
+	    SMSParts* old = static_cast<SMSParts*>(l->get());
+	    if (!old->m_expires)
+		continue;
+	    Debug(DebugMild, "SMS reassembly over %u bytes, handing over '%s' partial", m_smsMemory, old->c_str());
+	    old->m_expires = 0;
+	    keep -= old->m_bytes;
+	}
+    }
+    m_smsMutex.unlock();
+}
+
+void DevicesEndPoint::pumpSMS()
+{
+    Lock lock(m_mutex);
+    for (ObjList* l = m_devices.skipNull(); l; l = l->skipNext())
+	static_cast<CardDevice*>(l->get())->smsPump();
+}
+
+void DevicesEndPoint::setupReassembly(unsigned int timeout, unsigned int memory)
 {
+    Lock lock(m_smsMutex);
+    m_smsTimeout = timeout * 1000;
+    m_smsMemory = memory;
+}
+
+void DevicesEndPoint::flushSMS(bool all)
+{
+    // Devices are not deleted while the list is locked
+    Lock lock(m_mutex);
+    ObjList due;
+    m_smsMutex.lock();
+    u_int64_t now = Time::msecNow();
+    for (ObjList* l = m_smsParts.skipNull(); l; )
+    {
+	SMSParts* msg = static_cast<SMSParts*>(l->get());
+	if (all || msg->m_expires <= now)
+	{
+	    m_smsBytes -= msg->m_bytes;
+	    due.append(l->remove(false));
+	    l = l->skipNull();
+	}
+	else
+	    l = l->skipNext();
+    }
+    m_smsMutex.unlock();
+
+    for (ObjList* l = due.skipNull(); l; l = l->skipNext())
+    {
+	SMSParts* msg = static_cast<SMSParts*>(l->get());
+	Debug(DebugNote, "[%s] SMS from %s incomplete, got %u of %u parts", msg->m_device->c_str(),
+	    msg->m_caller.c_str(), msg->m_received, msg->m_parts);
+	onReceiveSMS(msg->m_device, msg->m_caller, String::empty(), msg->text(), msg->m_parts, true);
+    }
 }
 
 void DevicesEndPoint::onUpdateNetworkStatus(CardDevice* dev)
 {
 }
 
-bool DevicesEndPoint::sendSMS(CardDevice* dev, const String &called, const String &sms)
+void DevicesEndPoint::onSendSMS(CardDevice* dev, const String& called, const String& id, bool sent, unsigned int parts)
+{
+}
+
+bool DevicesEndPoint::sendSMS(CardDevice* dev, const String &called, const String &sms, const String &id)
 {
     if (!dev)
     {
         Debug(DebugAll, "DevicesEndPoint::sendSMS() error: dev is NULL");
         return false;
     }
-    return dev->sendSMS(called, sms);
+    return dev->sendSMS(called, sms, id);
 }
 
 bool DevicesEndPoint::sendUSSD(CardDevice* dev, const String &ussd)
@@ -904,50 +1597,392 @@ CardDevice* DevicesEndPoint::appendDevice(String name, NamedList* data)
 	dev->m_u2diag = -1;
     dev->m_callingpres = data->getIntValue("callingpres",-1);
     dev->m_disablesms = data->getBoolValue("disablesms",false);
+    dev->m_pipeline = data->getBoolValue("pipeline",false);
+    dev->m_sms_ref16 = data->getBoolValue("smsref16",false);
+    dev->m_sms_rate = data->getIntValue("smsrate",0);
+    dev->m_sms_burst = data->getIntValue("smsburst",1);
+    if (dev->m_sms_burst < 1)
+	dev->m_sms_burst = 1;
+    dev->m_sms_retries = data->getIntValue("smsretries",DEF_SMS_RETRIES);
+    dev->m_sms_spool_max = data->getIntValue("smsspool",DEF_SMS_SPOOL);
+    dev->m_group = data->getValue("group");
+    dev->m_call_budget = data->getIntValue("callbudget",0) * 60;
+    dev->m_sms_budget = data->getIntValue("smsbudget",0);
+    int audiobuffer = data->getIntValue("audiobuffer",DEF_AUDIO_BUFFER);
+    if (audiobuffer < 2 * FRAME_MSEC)
+	audiobuffer = 2 * FRAME_MSEC;
+    int jittermin = data->getIntValue("jittermin",DEF_JITTER_MIN);
+    int jittermax = data->getIntValue("jittermax",DEF_JITTER_MAX);
+    if (jittermin < 0)
+	jittermin = 0;
+    if (jittermax < jittermin)
+	jittermax = jittermin;
+    dev->m_jitter.configure(jittermin, jittermax, audiobuffer * FRAME_SIZE / FRAME_MSEC);
 
     m_mutex.lock();
     m_devices.append(dev);
+    m_rewatch = true;
+    m_indexMutex.lock();
+    m_byName.append(new DeviceKey(name, dev));
+    if (!dev->m_group.null())
+    {
+	DeviceGroup* group = static_cast<DeviceGroup*>(m_groups[dev->m_group]);
+	if (!group)
+	{
+	    group = new DeviceGroup(dev->m_group);
+	    m_groups.append(group);
+	}
+	group->append(dev);
+    }
+    m_indexMutex.unlock();
     m_mutex.unlock();
     return dev;
 }
 
+CardDevice* DevicesEndPoint::selectDevice(const String& group, DeviceGroup::Policy policy)
+{
+    m_indexMutex.lock();
+    DeviceGroup* g = static_cast<DeviceGroup*>(m_groups[group]);
+    m_indexMutex.unlock();
+    if (!g)
+	return 0;
+    // Another call may take the device between the scan and reserve()
+    for (int i = 0; i < 3; i++)
+    {
+	CardDevice* dev = g->pick(policy, Time::msecNow());
+	if (!dev)
+	    return 0;
+	if (dev->reserve())
+	    return dev;
+    }
+    return 0;
+}
+
+// Device indexed under key in the hash list, NULL if none or key is empty
+static CardDevice* lookupDevice(const HashList& index, const String& key)
+{
+    if (key.null())
+	return 0;
+    DeviceKey* entry = static_cast<DeviceKey*>(index[key]);
+    return entry ? entry->m_device : 0;
+}
+
+// Move the entry of a device from the key it had to a new one
+static void reindexDevice(HashList& index, CardDevice* dev, String& indexed, const String& key)
+{
+    if (indexed == key)
+	return;
+    if (!indexed.null())
+    {
+	ObjList* l = index.getHashList(indexed);
+	for (l = l ? l->skipNull() : 0; l; l = l->skipNext())
+	{
+	    DeviceKey* entry = static_cast<DeviceKey*>(l->get());
+	    if (entry->m_device == dev && *entry == indexed)
+	    {
+		l->remove();
+		break;
+	    }
+	}
+    }
+    indexed = key;
+    if (key.null())
+	return;
+    // A SIM moved between modems, the other one did not see it go yet
+    GenObject* stale = index[key];
+    if (stale)
+	index.remove(stale, true, true);
+    index.append(new DeviceKey(key, dev));
+}
+
 CardDevice* DevicesEndPoint::findDevice(const String &name)
 {
-    Lock lock(m_mutex);
-    return static_cast<CardDevice*>(m_devices[name]);
+    Lock lock(m_indexMutex);
+    return lookupDevice(m_byName, name);
 }
 
 CardDevice* DevicesEndPoint::findDevice(const NamedList &list)
+{
+    Lock lock(m_indexMutex);
+    CardDevice* dev = lookupDevice(m_byImei, list["imei"]);
+    return dev ? dev : lookupDevice(m_byImsi, list["imsi"]);
+}
+
+void DevicesEndPoint::indexDevice(CardDevice* dev)
+{
+    m_indexMutex.lock();
+    reindexDevice(m_byImei, dev, dev->m_index_imei, dev->getImei());
+    reindexDevice(m_byImsi, dev, dev->m_index_imsi, dev->getImsi());
+    m_indexMutex.unlock();
+
+    const String& imsi = dev->m_index_imsi;
+    Lock lock(m_budgetMutex);
+    if (imsi.null())
+    {
+	dev->m_budget = 0;
+	return;
+    }
+    SIMBudget* budget = static_cast<SIMBudget*>(m_budgets[imsi]);
+    if (!budget)
+    {
+	budget = new SIMBudget(imsi, m_budgetDay);
+	m_budgets.append(budget);
+    }
+    dev->m_budget = budget;
+}
+
+// Local date as YYYYMMDD, budgets follow the operator's day
+static unsigned int budgetDay()
+{
+    time_t t = ::time(0);
+    struct tm tm;
+    ::localtime_r(&t, &tm);
+    return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+bool SIMBudget::roll(unsigned int day)
+{
+    if (m_day == day)
+	return false;
+    m_day = day;
+    m_callSeconds = 0;
+    m_sms = 0;
+    return true;
+}
+
+void DevicesEndPoint::loadBudgets(const String& file)
+{
+    Lock lock(m_budgetMutex);
+    m_budgetFile = file;
+    m_budgetDay = budgetDay();
+    Configuration cfg(file);
+    unsigned int n = cfg.sections();
+    for (unsigned int i = 0; i < n; i++)
+    {
+	NamedList* sect = cfg.getSection(i);
+	if (!sect || sect->null() || m_budgets[*sect])
+	    continue;
+	SIMBudget* budget = new SIMBudget(*sect, sect->getIntValue("day",0));
+	budget->m_callSeconds = sect->getIntValue("callseconds",0);
+	budget->m_sms = sect->getIntValue("sms",0);
+	budget->roll(m_budgetDay);
+	m_budgets.append(budget);
+    }
+    Debug(DebugAll, "Loaded %u SIM budgets from '%s'", m_budgets.count(), file.c_str());
+}
+
+void DevicesEndPoint::chargeSMS(SIMBudget* budget)
+{
+    Lock lock(m_budgetMutex);
+    budget->m_sms++;
+    m_budgetDirty = true;
+}
+
+void DevicesEndPoint::chargeCall(SIMBudget* budget, unsigned int seconds)
+{
+    Lock lock(m_budgetMutex);
+    budget->m_callSeconds += seconds;
+    m_budgetDirty = true;
+}
+
+void DevicesEndPoint::saveBudgets()
+{
+    // Charges wait for the save, none may land between copy and clearing
+    Lock lock(m_budgetMutex);
+    m_budgetSaved = Time::secNow();
+    if (!m_budgetDirty || m_budgetFile.null())
+	return;
+    m_budgetDirty = false;
+    Configuration cfg;
+    cfg = m_budgetFile;
+    for (unsigned int i = 0; i < m_budgets.length(); i++)
+    {
+	ObjList* l = m_budgets.getList(i);
+	for (l = l ? l->skipNull() : 0; l; l = l->skipNext())
+	{
+	    SIMBudget* budget = static_cast<SIMBudget*>(l->get());
+	    cfg.setValue(*budget, "day", (int)budget->m_day);
+	    cfg.setValue(*budget, "callseconds", (int)budget->m_callSeconds);
+	    cfg.setValue(*budget, "sms", (int)budget->m_sms);
+	}
+    }
+    if (!cfg.save())
+	Debug(DebugWarn, "Could not save SIM budgets to '%s'", m_budgetFile.c_str());
+}
+
+// New day: clear the counters. Changes are saved every DC_BUDGET_SAVE sec
+void DevicesEndPoint::checkBudgets()
+{
+    unsigned int day = budgetDay();
+    m_budgetMutex.lock();
+    if (day != m_budgetDay)
+    {
+	m_budgetDay = day;
+	for (unsigned int i = 0; i < m_budgets.length(); i++)
+	{
+	    ObjList* l = m_budgets.getList(i);
+	    for (l = l ? l->skipNull() : 0; l; l = l->skipNext())
+		if (static_cast<SIMBudget*>(l->get())->roll(day))
+		    m_budgetDirty = true;
+	}
+    }
+    bool save = m_budgetDirty && Time::secNow() >= m_budgetSaved + DC_BUDGET_SAVE;
+    m_budgetMutex.unlock();
+    if (save)
+	saveBudgets();
+}
+
+unsigned int DevicesEndPoint::startReactors(unsigned int count)
 {
     Lock lock(m_mutex);
+    if (m_reactors || !count)
+	return m_reactorCount;
 
-    const ObjList *devicesIter = &m_devices;
-    while (devicesIter)
+    m_reactors = new ATReactor*[count];
+    for (unsigned int i = 0; i < count; i++)
     {
-	GenObject* obj = devicesIter->get();
-	devicesIter = devicesIter->next();
-	if (!obj) continue;
-	CardDevice* dev = static_cast<CardDevice*>(obj);
-	if((dev->getImei() == list["imei"]) || (dev->getImsi() == list["imsi"]))
-	    return dev;
+	ATReactor* r = new ATReactor(this, i);
+	m_reactorMutex.lock();
+	m_reactorsLive++;
+	m_reactorMutex.unlock();
+	if (!r->valid() || !r->startup())
+	{
+	    Debug(DebugWarn, "Failed to start AT reactor %u", i);
+	    delete r;
+	    break;
+	}
+	m_reactors[m_reactorCount++] = r;
     }
-    return 0;
+    return m_reactorCount;
 }
 
-void DevicesEndPoint::cleanDevices()
+void DevicesEndPoint::stopReactors()
 {
-    CardDevice* dev = 0;
     m_mutex.lock();
-    const ObjList *devicesIter = &m_devices;
-    while (devicesIter)
+    for (unsigned int i = 0; i < m_reactorCount; i++)
+	m_reactors[i]->stop();
+    for (unsigned int i = 0; i < m_mediaReactorCount; i++)
+	m_mediaReactors[i]->stop();
+    // Nobody may pick a stopping reactor, the threads are not ours anymore
+    ATReactor** reactors = m_reactors;
+    MediaReactor** mediaReactors = m_mediaReactors;
+    m_reactors = 0;
+    m_reactorCount = 0;
+    m_mediaReactors = 0;
+    m_mediaReactorCount = 0;
+    m_mutex.unlock();
+
+    // Threads delete themselves when they exit, wait until all are gone so
+    //  none still runs a device
+    for (;;)
     {
-	GenObject* obj = devicesIter->get();
-	devicesIter = devicesIter->next();
-	if (!obj) continue;
-	dev = static_cast<CardDevice*>(obj);
+	m_reactorMutex.lock();
+	unsigned int live = m_reactorsLive;
+	m_reactorMutex.unlock();
+	if (!live)
+	    break;
+	Thread::idle();
+    }
+    delete[] reactors;
+    delete[] mediaReactors;
+}
+
+void DevicesEndPoint::reactorGone()
+{
+    Lock lock(m_reactorMutex);
+    m_reactorsLive--;
+}
+
+unsigned int DevicesEndPoint::startMediaReactors(unsigned int count, bool pin)
+{
+    Lock lock(m_mutex);
+    if (m_mediaReactors || !count)
+	return m_mediaReactorCount;
+
+    // Enough slots for all devices to end up on one thread
+    unsigned int slots = m_devices.count();
+    m_mediaReactors = new MediaReactor*[count];
+    for (unsigned int i = 0; i < count; i++)
+    {
+	MediaReactor* r = new MediaReactor(this, i, slots, pin);
+	m_reactorMutex.lock();
+	m_reactorsLive++;
+	m_reactorMutex.unlock();
+	if (!r->valid() || !r->startup())
+	{
+	    Debug(DebugWarn, "Failed to start media reactor %u", i);
+	    delete r;
+	    break;
+	}
+	m_mediaReactors[m_mediaReactorCount++] = r;
+    }
+    return m_mediaReactorCount;
+}
+
+MediaReactor* DevicesEndPoint::mediaReactor()
+{
+    Lock lock(m_mutex);
+    MediaReactor* best = 0;
+    unsigned int bestLoad = 0;
+    for (unsigned int i = 0; i < m_mediaReactorCount; i++)
+    {
+	unsigned int load = m_mediaReactors[i]->load();
+	if (!best || load < bestLoad)
+	{
+	    best = m_mediaReactors[i];
+	    bestLoad = load;
+	}
+    }
+    return best;
+}
+
+ATReactor* DevicesEndPoint::reactor()
+{
+    Lock lock(m_mutex);
+    ATReactor* best = 0;
+    unsigned int bestLoad = 0;
+    for (unsigned int i = 0; i < m_reactorCount; i++)
+    {
+	unsigned int load = m_reactors[i]->load();
+	if (!best || load < bestLoad)
+	{
+	    best = m_reactors[i];
+	    bestLoad = load;
+	}
+    }
+    return best;
+}
+
+void DevicesEndPoint::disconnectDevices()
+{
+    Lock lock(m_mutex);
+    for (ObjList* l = m_devices.skipNull(); l; l = l->skipNext())
+    {
+	CardDevice* dev = static_cast<CardDevice*>(l->get());
+	dev->m_mutex.lock();
 	dev->disconnect();
-	m_devices.remove(obj, true); // Remove from list and delete object
+	dev->m_mutex.unlock();
     }
+}
+
+void DevicesEndPoint::cleanDevices()
+{
+    // Devices are detached first, then wait for the reactors to finish their
+    //  last round. Discovery may connect some again meanwhile, without reactors
+    disconnectDevices();
+    stopReactors();
+    m_mutex.lock();
+    disconnectDevices();
+    // No more parts can arrive, hand over what the devices left
+    flushSMS(true);
+    m_indexMutex.lock();
+    m_byName.clear();
+    m_byImei.clear();
+    m_byImsi.clear();
+    m_groups.clear();
+    m_indexMutex.unlock();
+    saveBudgets();
+    m_devices.clear(); // Remove from list and delete objects
     m_mutex.unlock();
 }
 
@@ -975,6 +2010,15 @@ String DevicesEndPoint::devicesStatus()
     return ret;
 }
 
+String DevicesEndPoint::devicesStats()
+{
+    String ret;
+    Lock lock(m_mutex);
+    for (ObjList* l = m_devices.skipNull(); l; l = l->skipNext())
+	ret << static_cast<CardDevice*>(l->get())->getStats() << ";";
+    return ret;
+}
+
 bool DevicesEndPoint::onIncamingCall(CardDevice* dev, const String &caller)
 {
     return false;
@@ -1009,7 +2053,7 @@ bool Connection::sendAnswer()
 
     m_dev->m_mutex.lock();
     if (m_dev->m_incoming)
-	m_dev->m_commandQueue.append(new ATCommand("ATA", CMD_AT_A));
+	m_dev->queueCommand(new ATCommand("ATA", CMD_AT_A));
     m_dev->m_mutex.unlock();
 
     return true;
@@ -1034,7 +2078,7 @@ bool Connection::sendHangup()
 
     if (tmp->m_needchup)
     {
-	tmp->m_commandQueue.append(new ATCommand("AT+CHUP", CMD_AT_CHUP));
+	tmp->queueCommand(new ATCommand("AT+CHUP", CMD_AT_CHUP));
 	tmp->m_needchup = 0;
     }
 
@@ -1052,7 +2096,7 @@ bool Connection::sendDTMF(char digit)
 
     m_dev->m_mutex.lock();
     if(m_dev->isDTMFValid(digit))
-	m_dev->m_commandQueue.append(new ATCommand("AT^DTMF=1," + digit, CMD_AT_DTMF));
+	m_dev->queueCommand(new ATCommand("AT^DTMF=1," + digit, CMD_AT_DTMF));
     m_dev->m_mutex.unlock();
 
     return true;
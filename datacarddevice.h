@@ -26,16 +26,34 @@
 
 
 #define FRAME_SIZE 320
+#define FRAME_MSEC 20
+#define DEF_AUDIO_BUFFER 400	/* msec of outbound audio buffered per device */
+#define DEF_JITTER_MIN 40	/* msec, lowest jitter buffer delay */
+#define DEF_JITTER_MAX 200	/* msec, jitter buffer latency cap */
+#define JB_WINDOW 50		/* frames between jitter buffer delay adjustments */
 #define RDBUFF_MAX 1024
+#define WRBUFF_MAX 2048	/* data tty output waiting for the modem to take it */
+
+#define DC_REACTOR_EVENTS 64	/* events fetched per epoll_wait() */
+#define DC_REACTOR_TICK 250	/* msec between device timer runs */
+#define DC_PIPELINE_MAX 8	/* pipelined commands waiting for response */
+#define DC_WHEEL_SLOTS 64	/* reactor timer wheel slots of DC_REACTOR_TICK */
+#define DC_CMD_TIMEOUT 3000	/* msec, default AT command response timeout */
+#define DC_CMD_RETRIES 2	/* default AT command resends on timeout */
+#define DC_TRIE_STATES 256	/* result classifier trie states */
+#define DC_TRIE_SYMBOLS 48	/* distinct characters in result prefixes */
+#define DC_SMS_PARTS_MAX 32	/* parts of a concatenated outgoing SMS */
+#define DC_SMS_RETRY_DELAY 5000	/* msec before resending a part the modem refused */
+#define DEF_SMS_SPOOL 100	/* outgoing messages waiting on a device */
+#define DEF_SMS_RETRIES 2	/* resends of a refused part */
+#define DEF_SMS_REASSEMBLY_TIMEOUT 300	/* sec to wait for missing parts of incoming SMS */
+#define DEF_SMS_REASSEMBLY_MEMORY 262144	/* bytes of incoming SMS parts held */
+#define DC_DEVICE_HASH 127	/* buckets of the device name, IMEI and IMSI indexes */
+#define DC_RESERVE_MSEC 2000	/* device picked from a group stays taken until its call starts */
+#define DC_BUDGET_SAVE 60	/* sec between saves of changed SIM budgets */
 
 using namespace TelEngine;
 
-typedef enum {
-  BLT_STATE_WANT_CONTROL = 0,
-  BLT_STATE_WANT_CMD = 1,
-} blt_state_t;
-
-
 typedef enum {
 	CMD_UNKNOWN = 0,
 	CMD_AT,
@@ -78,6 +96,7 @@ typedef enum {
 	CMD_AT_Z,
 	CMD_AT_CMEE,
 	CMD_AT_CSMP,
+	CMD_AT_CMGL,
 } at_cmd_t;
 
 typedef enum {
@@ -88,6 +107,7 @@ typedef enum {
 	RES_BUSY,
 	RES_CEND,
 	RES_CLIP,
+	RES_CMGL,
 	RES_CMGR,
 	RES_CMS_ERROR,
 	RES_CMTI,
@@ -115,15 +135,28 @@ typedef enum {
 	RES_SRVST,
 } at_res_t;
 
+/* command queue classes, lower value is sent first */
+typedef enum {
+	PRIO_CALL = 0,
+	PRIO_DTMF,
+	PRIO_USSD,
+	PRIO_SMS,
+	PRIO_HOUSEKEEPING,
+	PRIO_COUNT,
+} at_prio_t;
+
 
 class CardDevice;
 class DevicesEndPoint;
 class Connection;
+class ATReactor;
+class MediaReactor;
 
 class ATCommand : public GenObject
 {
 public:
-    ATCommand(String command, at_cmd_t cmd, GenObject* obj = 0, at_res_t res = RES_OK):m_command(command),m_cmd(cmd),m_res(res),m_obj(obj)
+    ATCommand(String command, at_cmd_t cmd, GenObject* obj = 0, at_res_t res = RES_OK):m_command(command),m_cmd(cmd),m_res(res),m_obj(obj),m_pipeline(false),
+	m_timeout(0),m_retries(0),m_deadline(0)
     {
 	if(m_obj)
 	{
@@ -143,6 +176,29 @@ public:
 	return m_obj;
     }
 
+    /**
+     * Allow sending this command before responses to previous ones arrived
+     * @return this command
+     */
+    ATCommand* pipelined()
+    {
+	m_pipeline = true;
+	return this;
+    }
+
+    /**
+     * Override default timeout policy of the command type
+     * @param timeout - msec to wait for response once the command is sent
+     * @param retries - times to resend the command on timeout
+     * @return this command
+     */
+    ATCommand* policy(unsigned int timeout, unsigned int retries)
+    {
+	m_timeout = timeout;
+	m_retries = retries;
+	return this;
+    }
+
     virtual void onTimeout()
     {
 	Debug(DebugAll, "Timeout for AT command %s ignoring ", m_command.safe());
@@ -154,6 +210,174 @@ public:
     at_res_t m_res;
 
     GenObject* m_obj;
+    bool m_pipeline;	//may be sent while other pipelined commands wait for response
+    unsigned int m_timeout;	//msec to wait for response, 0 for type default
+    unsigned int m_retries;	//resends left
+    u_int64_t m_deadline;	//msec when response is late, 0 if not waiting
+};
+
+/**
+ * A message sent as one or more concatenated SMS, one AT+CMGS per part.
+ * Waits in the spool of its device, which sends the parts one at a time,
+ *  and reports the result of the whole message once it is sent or given up
+ */
+class OutgoingSMS : public RefObject
+{
+public:
+    OutgoingSMS(DevicesEndPoint* ep, CardDevice* dev, const String& called, const String& id,
+	unsigned int parts, unsigned int retries);
+    ~OutgoingSMS();
+
+    /**
+     * Keep the encoded PDU of a part
+     * @param part - part index, from 0
+     * @param pdu - hex PDU including SMSC
+     * @param len - TPDU length given to AT+CMGS
+     */
+    void setPart(unsigned int part, const char* pdu, int len);
+
+    /**
+     * Build the command sending the next part, the part is busy until the
+     *  command is answered or deleted
+     * @return AT+CMGS command
+     */
+    ATCommand* command();
+
+    /**
+     * Account for the outcome of the part being sent, report when the
+     *  message is done
+     * @param sent - the modem accepted the part, a refused part is resent
+     *  while retries last
+     */
+    void partDone(bool sent);
+
+    /**
+     * The command of the busy part was deleted unanswered, the device went
+     *  away. The part is sent again later
+     */
+    inline void interrupted()
+	{ m_busy = false; }
+
+    /**
+     * Give up on the message and report it failed, if it is not done yet
+     */
+    void abort();
+
+    /**
+     * Check if all parts were sent or the message failed
+     */
+    inline bool done() const
+	{ return m_failed || m_next >= m_parts; }
+
+    /**
+     * Check if the next part may be sent
+     * @param now - current time in msec
+     */
+    inline bool ready(u_int64_t now) const
+	{ return !(m_busy || done()) && now >= m_retryAt; }
+
+private:
+    DevicesEndPoint* m_endpoint;
+    CardDevice* m_device;
+    String m_called;
+    String m_id;
+    unsigned int m_parts;
+    String* m_pdu;
+    int* m_len;
+    unsigned int m_next;	//part to send
+    unsigned int m_retries;	//configured resends of a part
+    unsigned int m_left;	//resends left for the next part
+    u_int64_t m_retryAt;	//msec the next part may be resent
+    bool m_busy;
+    bool m_failed;
+};
+
+/**
+ * AT+CMGS of one part of an outgoing message, the PDU is sent at the prompt.
+ * A part deleted without a final response is sent again later
+ */
+class SMSCommand : public ATCommand
+{
+public:
+    SMSCommand(const String& command, const char* pdu, OutgoingSMS* sms);
+    virtual ~SMSCommand();
+
+    /**
+     * Report the part sent, on final OK
+     */
+    void sent();
+
+    /**
+     * Report the part refused, on ERROR, +CMS ERROR or timeout
+     */
+    void failed();
+
+private:
+    OutgoingSMS* m_sms;
+    bool m_done;
+};
+
+/**
+ * Multi level queue of AT commands waiting to be sent.
+ * Commands are taken from the highest priority class first and in order
+ *  within a class, so call control never waits behind SMS or status polling
+ */
+class CommandQueue
+{
+public:
+    CommandQueue();
+
+    /**
+     * Get priority class of a command type
+     * @param cmd - command type
+     * @return class the command is queued in
+     */
+    static at_prio_t prio(at_cmd_t cmd);
+
+    /**
+     * Add command at the end of its class
+     * @param cmd - command to queue, owned by the queue
+     */
+    void append(ATCommand* cmd);
+
+    /**
+     * Add command in front of its class
+     * @param cmd - command to queue, owned by the queue
+     */
+    void insert(ATCommand* cmd);
+
+    /**
+     * Next command to send
+     * @return first command of the highest non empty class or NULL
+     */
+    ATCommand* get() const;
+
+    /**
+     * Take command out of the queue without deleting it
+     * @param cmd - queued command
+     */
+    void remove(ATCommand* cmd);
+
+    /**
+     * Delete all queued commands
+     */
+    void clear();
+
+    /**
+     * Count of queued commands
+     */
+    unsigned int count() const;
+
+    /**
+     * Append per class depth and peak depth to a stats string
+     * @param ret - string to append to
+     */
+    void stats(String& ret) const;
+
+private:
+    ObjList m_queue[PRIO_COUNT];
+    unsigned int m_depth[PRIO_COUNT];
+    unsigned int m_peak[PRIO_COUNT];
 };
 
 /**
@@ -172,6 +396,192 @@ private:
     CardDevice* m_device; //pointer to device
 };
 
+/**
+ * Thread for processing data ttys of many devices.
+ * Replaces MonitorThread when the endpoint runs in reactor mode
+ */
+class ATReactor : public Thread
+{
+public:
+    ATReactor(DevicesEndPoint* owner, unsigned int index);
+    ~ATReactor();
+    virtual void run();
+
+    /**
+     * Start watching device data tty
+     * @param dev - connected device
+     * @return true on success or false on error
+     */
+    bool attach(CardDevice* dev);
+
+    /**
+     * Stop watching device data tty. Must be called before closing it
+     * @param dev - device to remove
+     */
+    void detach(CardDevice* dev);
+
+    /**
+     * Refresh events we wait for on device data tty (device must be locked)
+     * @param dev - attached device
+     */
+    void update(CardDevice* dev);
+
+    /**
+     * Count of attached devices
+     */
+    unsigned int load();
+
+    /**
+     * Arm timer for a device command deadline
+     * @param dev - attached device
+     * @param when - msec when the device must check its command
+     */
+    void schedule(CardDevice* dev, u_int64_t when);
+
+    void stop();
+
+    inline bool valid() const
+	{ return m_epoll >= 0; }
+
+private:
+    void expire(u_int64_t now);
+
+    DevicesEndPoint* m_owner;
+    unsigned int m_index;
+    int m_epoll;
+    bool m_running;
+    Mutex m_mutex;
+    ObjList m_devices; //attached devices, not owned
+    ObjList m_wheel[DC_WHEEL_SLOTS]; //pending deadlines hashed by tick
+    u_int64_t m_wheelTick; //last tick expired
+};
+
+/**
+ * Fixed size single producer / single consumer byte ring for outbound audio.
+ * Neither side locks, positions are published with memory barriers
+ */
+class AudioRing
+{
+public:
+    AudioRing();
+    ~AudioRing();
+
+    /**
+     * Allocate storage. Must not be called while audio flows
+     * @param size - capacity in bytes, rounded up to a power of two
+     */
+    void resize(unsigned int size);
+
+    /**
+     * Append data. Called by producer only
+     * @param data - data to store
+     * @param len - data length
+     * @return count of bytes stored, less than len on overflow
+     */
+    unsigned int put(const char* data, unsigned int len);
+
+    /**
+     * Fetch data. Called by consumer only
+     * @param data - destination buffer
+     * @param len - count of bytes wanted
+     * @return count of bytes copied, less than len on underrun
+     */
+    unsigned int get(char* data, unsigned int len);
+
+    /**
+     * Count of buffered bytes. Exact for consumer only
+     */
+    inline unsigned int avail() const
+	{ return m_head - m_tail; }
+
+    /**
+     * Drop buffered data. Called by consumer only
+     * @param len - count of bytes to drop
+     */
+    void skip(unsigned int len);
+
+    inline unsigned int size() const
+	{ return m_size; }
+
+    u_int32_t m_overflows;	//put() calls that dropped data
+
+private:
+    char* m_buf;
+    unsigned int m_size;
+    volatile unsigned int m_head;	//write position, owned by producer
+    volatile unsigned int m_tail;	//read position, owned by consumer
+};
+
+/**
+ * Adaptive jitter buffer in front of the audio tty.
+ * Producer places audio by timestamp, late data is dropped and gaps are
+ *  filled with silence. Consumer plays out one frame per modem frame and
+ *  adapts the delay between configured bounds
+ */
+class JitterBuffer
+{
+public:
+    JitterBuffer();
+
+    /**
+     * Set delay bounds. Must not be called while audio flows
+     * @param minDelay - lowest target delay in msec
+     * @param maxDelay - latency cap in msec
+     * @param size - ring capacity in bytes
+     */
+    void configure(unsigned int minDelay, unsigned int maxDelay, unsigned int size);
+
+    /**
+     * Store audio received from Yate. Called by producer only
+     * @param data - slin data
+     * @param len - data length
+     * @param tStamp - timestamp in samples of the first byte
+     * @return count of bytes stored
+     */
+    unsigned int put(const char* data, unsigned int len, unsigned long tStamp);
+
+    /**
+     * Fetch next frame to play. Called by consumer only
+     * @param frame - buffer of FRAME_SIZE bytes
+     * @return count of bytes copied, caller pads the rest with silence
+     */
+    unsigned int get(char* frame);
+
+    /**
+     * Drop buffered audio and restart timing on both sides. Safe from any thread
+     */
+    inline void flush()
+	{ m_resync = true; m_reset = true; }
+
+    /**
+     * Current target delay in msec
+     */
+    inline unsigned int delay() const
+	{ return m_target * FRAME_MSEC / FRAME_SIZE; }
+
+    AudioRing m_ring;
+    u_int32_t m_late;		//chunks dropped for arriving after their play time
+    u_int32_t m_concealed;	//gaps filled with silence
+    u_int32_t m_underruns;	//frames played short
+    u_int32_t m_dropped;	//frames discarded to reduce delay
+
+private:
+    // producer side
+    volatile bool m_resync;
+    bool m_started;
+    unsigned long m_nextStamp;
+    // consumer side
+    volatile bool m_reset;
+    bool m_buffering;
+    unsigned int m_min;		//bytes
+    unsigned int m_max;		//bytes
+    unsigned int m_target;	//bytes
+    unsigned int m_lowWater;	//lowest fill seen in window
+    unsigned int m_ticks;	//frames played in window
+    bool m_underrun;		//underrun or late audio seen in window
+    u_int32_t m_lateSeen;	//m_late value at last check
+};
+
 /**
  * Thread for handling media data.
  * Receiving audio data from tty to core
@@ -188,6 +598,62 @@ private:
     CardDevice* m_device; //pointer to device
 };
 
+/**
+ * Per device state kept by MediaReactor
+ */
+struct MediaSlot
+{
+    CardDevice* volatile dev;	//device served in this slot, NULL if free, read unlocked
+};
+
+/**
+ * Thread handling audio ttys of many devices.
+ * Replaces per device MediaThread when media threads are pooled
+ */
+class MediaReactor : public Thread
+{
+public:
+    MediaReactor(DevicesEndPoint* owner, unsigned int index, unsigned int slots, bool pin);
+    ~MediaReactor();
+    virtual void run();
+
+    /**
+     * Start watching device audio tty
+     * @param dev - connected device
+     * @return true on success or false if no slot is free
+     */
+    bool attach(CardDevice* dev);
+
+    /**
+     * Stop watching device audio tty. Must be called before closing it
+     * @param dev - device to remove
+     */
+    void detach(CardDevice* dev);
+
+    /**
+     * Count of attached devices
+     */
+    unsigned int load();
+
+    void stop();
+
+    inline bool valid() const
+	{ return m_epoll >= 0; }
+
+private:
+    void pin();
+
+    DevicesEndPoint* m_owner;
+    unsigned int m_index;
+    int m_epoll;
+    bool m_running;
+    bool m_pin;
+    Mutex m_mutex;
+    MediaSlot* m_slots;
+    unsigned int m_size;
+    unsigned int m_used;
+};
+
 
 class DatacardConsumer : public DataConsumer
 {
@@ -208,6 +674,42 @@ private:
     CardDevice* m_device;
 };
 
+/**
+ * Daily usage of a SIM, named by IMSI so it follows the SIM between modems.
+ * Counted by the device the SIM is in, reset by the endpoint every day
+ */
+class SIMBudget : public String
+{
+public:
+    SIMBudget(const String& imsi, unsigned int day)
+	: String(imsi), m_day(day), m_callSeconds(0), m_sms(0)
+	{ }
+
+    /**
+     * Start counting a new day
+     * @param day - date as YYYYMMDD
+     * @return true if the counters were reset
+     */
+    bool roll(unsigned int day);
+
+    unsigned int m_day;		//date the counters are for, YYYYMMDD
+    unsigned int m_callSeconds;	//outgoing call time
+    unsigned int m_sms;		//SMS accepted by the modem
+};
+
+/**
+ * Directory watched for device ttys to show up, named by its path
+ */
+class TtyWatch : public String
+{
+public:
+    TtyWatch(const String& dir, int wd)
+	: String(dir), m_wd(wd)
+	{ }
+
+    int m_wd;			//inotify watch descriptor
+};
+
 
 /**
  * Device
@@ -215,6 +717,10 @@ private:
  */
 class CardDevice: public String
 {
+    friend class ATReactor;
+    friend class MediaReactor;
+    friend class ATBench;	// bench/at_bench.cpp drives the receive path
+    friend class DevicesEndPoint;	// keeps m_index_imei and m_index_imsi
 public:
     CardDevice(String name, DevicesEndPoint* ep);
     ~CardDevice();
@@ -228,6 +734,7 @@ public:
 
     bool getParams(NamedList* list);
     String getStatus();
+    String getStats();
 
 	//TODO: monitor cellular network parameters
 	//maybe using getStatus more correct?
@@ -243,29 +750,79 @@ public:
 	{ return m_consumer; }
 	
     inline bool isBusy()
-	{ Lock lock(m_mutex); return (!m_initialized || m_incoming || m_outgoing); }
+	{ Lock lock(m_mutex); return (!m_initialized || m_incoming || m_outgoing || m_conn
+	    || Time::msecNow() < m_reserved + DC_RESERVE_MSEC); }
+
+    /**
+     * Check without locking if the device can place a call, a snapshot
+     *  for group selection that reserve() confirms
+     * @param now - current time in msec
+     */
+    inline bool isFree(u_int64_t now) const
+	{ return m_connected && m_initialized && m_gsm_registered && !(m_incoming || m_outgoing || m_conn)
+	    && now >= m_reserved + DC_RESERVE_MSEC && callBudgetLeft(); }
+
+    /**
+     * Check if the SIM may still place calls today
+     */
+    inline bool callBudgetLeft() const
+	{ return !(m_budget && m_call_budget) || m_budget->m_callSeconds < m_call_budget; }
+
+    /**
+     * Check if the SIM may still send SMS today
+     */
+    inline bool smsBudgetLeft() const
+	{ return !(m_budget && m_sms_budget) || m_budget->m_sms < m_sms_budget; }
+
+    /**
+     * Signal strength for group selection
+     * @return RSSI 0-31, -1 if unknown
+     */
+    inline int signal() const
+	{ return (m_rssi >= 0 && m_rssi <= 31) ? m_rssi : -1; }
+
+    /**
+     * Take a device for an outgoing call, so concurrent calls do not pick
+     *  it until the call starts
+     * @param group - device was picked from a group, it must also be
+     *  registered and have call budget left
+     * @return true if the device is still free
+     */
+    bool reserve(bool group = true);
+
+    /**
+     * Drop the reservation once the call is placed or failed
+     */
+    void release();
 
 
 private:
     bool startMonitor();
+    bool startMedia();
     int devStatus(int fd);
 
     DevicesEndPoint* m_endpoint;
     MonitorThread* m_monitor;
+    ATReactor* m_reactor;
     MediaThread* m_media;
+    MediaReactor* m_media_reactor;
 
     DatacardConsumer* m_consumer;
     DatacardSource* m_source;
 
 public:
     Mutex m_mutex;
+    Mutex m_media_mutex;	//guards audio tty against disconnect while a frame is processed
     Connection* m_conn;
 
 public:
     int m_audio_fd;	// audio descriptor
     int m_data_fd;	//data  descriptor
 
-    DataBlock m_audio_buf;
+    JitterBuffer m_jitter;	//audio from Yate waiting to be written to tty
+    DataBlock m_rx_frame;	//frame read from tty, reused for every Forward()
+    unsigned long m_rx_stamp;	//samples read from tty
+    u_int32_t m_tx_drops;	//frames the audio tty did not take
 
     String getNumber()
 	{ return m_number; }
@@ -332,11 +889,38 @@ public:
     bool m_auto_delete_sms;
     bool m_reset_datacard;
     bool m_disablesms;
+    bool m_pipeline;			/* send safe commands without waiting for responses */
+    bool m_sms_ref16;			/* 16 bit reference for concatenated SMS */
+    unsigned int m_sms_rate;		/* SMS per minute, 0 for no limit */
+    unsigned int m_sms_burst;		/* SMS sent at once before the rate applies */
+    unsigned int m_sms_retries;		/* resends of a part refused by the modem */
+    unsigned int m_sms_spool_max;	/* outgoing messages waiting */
+    String m_group;			/* group outgoing calls may pick the device from */
+    unsigned int m_call_budget;		/* outgoing call seconds per SIM and day, 0 for no limit */
+    unsigned int m_sms_budget;		/* SMS per SIM and day, 0 for no limit */
 
 private:
-    blt_state_t m_state;
     char m_rd_buff[RDBUFF_MAX];
     int m_rd_buff_pos;
+    char m_wr_buff[WRBUFF_MAX];
+    unsigned int m_wr_buff_len;		/* output the data tty did not take yet */
+    u_int64_t m_rd_reads;		/* read() calls on data tty */
+    u_int64_t m_rd_lines;		/* lines handed to at_response() */
+    u_int64_t m_at_activity;		/* msec of last data tty read or write */
+    unsigned int m_at_events;		/* events watched by reactor */
+    u_int64_t m_at_pipelined;		/* commands sent while others were pending */
+    u_int64_t m_at_timeouts;		/* commands not answered in time */
+    u_int64_t m_at_retries;		/* commands resent after timeout */
+    unsigned int m_sms_ref;		/* reference of the last concatenated SMS */
+    ObjList m_sms_spool;		/* outgoing messages in order, kept over reconnects */
+    u_int64_t m_sms_tat;		/* msec the rate limit is paid up to */
+    u_int64_t m_sms_parts;		/* SMS accepted by the modem */
+    u_int64_t m_sms_errors;		/* SMS refused or timed out */
+
+public:
+    u_int64_t m_last_call;		/* msec the device was last picked for a call */
+    u_int64_t m_reserved;		/* msec the device was reserved for a call */
+    SIMBudget* m_budget;		/* usage of the SIM inserted, owned by the endpoint */
 
     // AT command methods.
 public:
@@ -353,14 +937,87 @@ public:
      */
     void processATEvents();
 
+    /**
+     * Handle data tty events reported by reactor
+     * @param events -- epoll events
+     */
+    void atEvent(unsigned int events);
+
+    /**
+     * Periodic link and timeout check run by reactor
+     * @param now -- current time in msec
+     */
+    void atTimer(u_int64_t now);
+
+    /**
+     * Append command to the queue and wake up the thread serving the device
+     * @param cmd -- command to send
+     */
+    void queueCommand(ATCommand* cmd);
+
+    /**
+     * Check deadline of the command waiting for response
+     * @param now -- current time in msec
+     * @return false if device was disconnected
+     */
+    bool atExpire(u_int64_t now);
+
 private:
 
     /**
-     * Convert command to result type
-     * @param command -- received command
-     * @return result type
+     * Reset command queue and start initialization
+     */
+    void atStart();
+
+    /**
+     * Check device ttys. Disconnect if lost
+     * @return false if device was disconnected
+     */
+    bool atCheckLink();
+
+    /**
+     * Check if we have a command to send
+     * @return true if next command may be sent
+     */
+    bool atWantWrite();
+
+    /**
+     * Send next queued command
+     */
+    void atWrite();
+
+    /**
+     * Release command answered by OK/ERROR and move on to the next pending one
+     */
+    void atCommandDone();
+
+    /**
+     * Queue identity queries, all at once when pipelining
+     */
+    void atQueueIdentity();
+
+    /**
+     * Start response timer of the command in front of the pipeline
+     */
+    void atArm();
+
+    /**
+     * Retry or fail the command in front of the pipeline
+     * @return false if device was disconnected
+     */
+    bool atTimeout();
+
+    /**
+     * Read data tty. Disconnect on error
+     * @return false if device was disconnected
      */
-    at_res_t at_read_result_classification(char* command);
+    bool atRead();
+
+    /**
+     * Handle data tty idle timeout
+     * @return false if device was disconnected
+     */
+    bool atIdle();
 
     /**
      * Do response
@@ -434,6 +1091,14 @@ private:
      */
     int at_response_cmgr(char* str, size_t len);
 
+    /**
+     * Handle +CMGL response, the PDU of a stored message follows
+     * @param str -- string containing response (null terminated)
+     * @param len -- string lenght
+     * @return 0 success or -1 parse error
+     */
+    int at_response_cmgl(char* str, size_t len);
+
     /**
      * Handle +CMTI response
      * @param str -- string containing response (null terminated)
@@ -565,6 +1230,12 @@ private:
      * @return 0 success or -1 parse error
      */
     int at_response_smmemfull();
+
+    /**
+     * Read every message in SMS storage with one AT+CMGL and delete them
+     *  with one AT+CMGD afterwards. Does nothing if a drain is under way
+     */
+    void smsDrain();
     
     /**
      * Send an SMS message from the queue.
@@ -602,6 +1273,13 @@ public:
      */
     const char* at_res2str(at_res_t res);
 
+    /**
+     * Convert command to result type by walking the result prefix trie
+     * @param command -- received command (null terminated)
+     * @return result type, RES_UNKNOWN if no known prefix matches
+     */
+    static at_res_t at_read_result_classification(const char* command);
+
 private:
 
     /**
@@ -622,6 +1300,17 @@ private:
      */
     int at_parse_cmgr(char* str, size_t len, int* stat, int* pdulen);
 
+    /**
+     * Parse a +CMGL line
+     * @param str -- string to parse (null terminated)
+     * @param len -- string lenght
+     * @param index -- storage index of the message
+     * @param stat -- message status
+     * @param pdulen -- TPDU length
+     * @return 0 success or -1 parse error
+     */
+    int at_parse_cmgl(char* str, size_t len, int* index, int* stat, int* pdulen);
+
     /**
      * Parse a CMTI notification
      * @param str -- string to parse (null terminated)
@@ -718,14 +1407,29 @@ private:
 
     /**
      * Write to data socket
-     * This function will write count characters from buf. It will always write
-     * count chars unless it encounters an error.
+     * This function will write count characters from buf and a CR. What a
+     * non blocking tty does not take now is kept and written when it is
+     * writable again.
      * @param buf -- buffer to write
      * @param count -- number of bytes to write
      * @return 0 success or -1 on error
      */
     int at_write_full(char* buf, size_t count);
 
+    /**
+     * Queue raw bytes for the data tty and write what it takes now
+     * @param buf -- buffer to write
+     * @param count -- number of bytes to write
+     * @return 0 success or -1 on error or if the output buffer is full
+     */
+    int atOutput(const char* buf, size_t count);
+
+    /**
+     * Write pending output to the data tty until it would block
+     * @return 0 success or -1 on error
+     */
+    int atFlush();
+
     /**
      * Send the SMS PDU message
      * @param pdu -- SMS PDU
@@ -748,10 +1452,18 @@ public:
     /**
      * Send SMS message
      * @param called - number of recepient
-     * @param sms - sms text body
-     * @return true on success or false on error
+     * @param sms - sms text body, split into concatenated SMS when long
+     * @param id - identifier echoed in the result of the message
+     * @return true if the message was spooled or false on error or if the
+     *  spool is full
+     */
+    bool sendSMS(const String &called, const String &sms, const String &id = String::empty());
+
+    /**
+     * Queue the next part from the SMS spool if the device is registered
+     *  and the rate limit allows it
      */
-    bool sendSMS(const String &called, const String &sms);
+    void smsPump();
 
     /**
      * Send USSD
@@ -760,8 +1472,19 @@ public:
      */
     bool sendUSSD(const String &ussd);
 
+    /**
+     * Read a frame from audio tty, forward it and write a frame back
+     * @param buf - scratch buffer of FRAME_SIZE bytes
+     */
+    void processAudio(char* buf);
+
+    /**
+     * Forward audio read from tty to Yate, stamped with the tty sample count
+     * @param data - slin data
+     * @param len - data length
+     */
     void forwardAudio(char* data, int len);
-    int sendAudio(char* data, int len);
+    int sendAudio(char* data, int len, unsigned long tStamp);
 
     /**
      * Create new call
@@ -777,12 +1500,17 @@ private:
     bool Hangup(int error);
     int getReason(int end_status, int cc_cause);
     bool m_incoming_pdu;
+    String m_index_imei;	//IMEI the endpoint found the device by
+    String m_index_imsi;	//IMSI the endpoint found the device by
+    bool m_sms_drain;		//AT+CMGL queued or listing
+    unsigned int m_sms_listed;	//messages listed by the current AT+CMGL
 
-    ATCommand* m_lastcmd;
+    ATCommand* m_lastcmd;	//oldest command waiting for response
+    ObjList m_pipelined;	//commands sent after m_lastcmd, in order
 public:
     bool isDTMFValid(char dtmf);
     bool encodeUSSD(const String& code, String& ret);
-    ObjList m_commandQueue;
+    CommandQueue m_commandQueue;
 };
 
 /**
@@ -807,6 +1535,102 @@ protected:
     CardDevice* m_dev;
 };
 
+/**
+ * Parts of an incoming concatenated SMS waiting for the rest of the message.
+ * Named by device, sender and reference
+ */
+class SMSParts : public String
+{
+public:
+    SMSParts(const String& key, CardDevice* dev, const String& caller, unsigned int parts, u_int64_t expires);
+    ~SMSParts();
+
+    /**
+     * Keep the text of one part
+     * @param part - part number, from 1
+     * @param text - text of the part
+     * @return bytes kept, 0 for a repeated or out of range part
+     */
+    unsigned int add(unsigned int part, const String& text);
+
+    /**
+     * Check if all parts arrived
+     */
+    inline bool complete() const
+	{ return m_received == m_parts; }
+
+    /**
+     * Join the text of the parts received so far in order
+     */
+    String text() const;
+
+    CardDevice* m_device;
+    String m_caller;
+    unsigned int m_parts;
+    unsigned int m_received;
+    unsigned int m_bytes;	//text kept
+    u_int64_t m_expires;	//msec to give up on missing parts, 0 to hand over now
+
+private:
+    String* m_text;
+    unsigned char m_got[32];	//bitmap of received parts
+};
+
+/**
+ * Entry of a device index, named by the key the device is found by
+ */
+class DeviceKey : public String
+{
+public:
+    DeviceKey(const String& key, CardDevice* dev)
+	: String(key), m_device(dev)
+	{ }
+
+    CardDevice* m_device;
+};
+
+/**
+ * Devices outgoing calls to a group target are placed through.
+ * Members are only added while devices are configured, so calls scan
+ *  them without locking
+ */
+class DeviceGroup : public String
+{
+public:
+    /**
+     * How a free device is picked
+     */
+    enum Policy {
+	RoundRobin,	// next free device after the last one picked
+	LeastRecent,	// free device picked longest ago
+	BestSignal,	// free device with highest RSSI
+    };
+
+    DeviceGroup(const String& name);
+    ~DeviceGroup();
+
+    /**
+     * Add a device to the group
+     * @param dev - device configured with this group
+     */
+    void append(CardDevice* dev);
+
+    /**
+     * Pick a free device, without locking. Concurrent picks may return the
+     *  same device, reserve() settles which call gets it
+     * @param policy - selection policy
+     * @param now - current time in msec
+     * @return device or NULL if none is free
+     */
+    CardDevice* pick(Policy policy, u_int64_t now);
+
+private:
+    CardDevice** m_members;
+    unsigned int m_count;
+    unsigned int m_alloc;
+    volatile unsigned int m_next;	//round robin position, moved with compare and swap
+};
+
 /**
  * Holds all currently created devices
  * Process incoming connections, SMS and USSD.
@@ -839,10 +1663,25 @@ public:
      * Call when new SMS message received.
      * @param dev - pointer to current device
      * @param caller - number of SMS sender
+     * @param udh_data - user data header, empty for reassembled messages
      * @param sms - SMS body
+     * @param parts - number of concatenated SMS the message came in
+     * @param partial - some parts never arrived
+     * @return
+     */
+    virtual void onReceiveSMS(CardDevice* dev, const String& caller, const String& udh_data, const String& sms,
+	unsigned int parts = 1, bool partial = false);
+
+    /**
+     * Call when all parts of an outgoing SMS are answered.
+     * @param dev - pointer to current device
+     * @param called - number of SMS recepient
+     * @param id - identifier given with the message, may be empty
+     * @param sent - true if every part was sent
+     * @param parts - number of SMS the message was split into
      * @return
      */
-    virtual void onReceiveSMS(CardDevice* dev, const String& caller, const String& udh_data, const String& sms);
+    virtual void onSendSMS(CardDevice* dev, const String& called, const String& id, bool sent, unsigned int parts);
 
     /**
      * Call when network status (rssi, lac, etc) changed. 
@@ -856,9 +1695,10 @@ public:
      * @param dev - pointer to current device
      * @param called - number of SMS recepient
      * @param sms - SMS body
+     * @param id - identifier echoed in the result of the message
      * @return
      */    
-    bool sendSMS(CardDevice* dev, const String &called, const String &sms);
+    bool sendSMS(CardDevice* dev, const String &called, const String &sms, const String &id = String::empty());
 
     /**
      * Send CUSD request.
@@ -868,6 +1708,36 @@ public:
      */    
     bool sendUSSD(CardDevice* dev, const String &ussd);
 
+    /**
+     * Keep a part of an incoming concatenated SMS until the message is whole,
+     * then hand it over with onReceiveSMS()
+     * @param dev - device that received the part
+     * @param caller - number of SMS sender
+     * @param ref - concatenation reference
+     * @param parts - number of parts of the message
+     * @param part - number of this part, from 1
+     * @param sms - text of the part
+     */
+    void reassembleSMS(CardDevice* dev, const String& caller, int ref, int parts, int part, const String& sms);
+
+    /**
+     * Configure incoming SMS reassembly
+     * @param timeout - sec to wait for missing parts before handing over
+     *  what arrived
+     * @param memory - bytes of text kept, the oldest messages are handed
+     *  over partial above it
+     */
+    void setupReassembly(unsigned int timeout, unsigned int memory);
+
+    /**
+     * Connect devices as soon as their ttys show up instead of waiting for
+     *  the next discovery. Polling goes on as fallback, for devices whose
+     *  ttys are all present
+     * @param enable - watch the tty directories with inotify
+     * @return true if the ttys are watched
+     */
+    bool setupHotplug(bool enable);
+
     /**
      * Append new device to endpoint.
      * @param name - unique device name for future access
@@ -885,11 +1755,50 @@ public:
 
     /**
      * Find device by params
-     * @param list - device params
+     * @param list - device params, imei is looked up first then imsi
      * @return device pointer or NULL if not found
      */
     CardDevice* findDevice(const NamedList &list);
 
+    /**
+     * Pick and reserve a free device of a group for an outgoing call
+     * @param group - group name
+     * @param policy - selection policy
+     * @return device or NULL if the group is unknown or has no free device
+     */
+    CardDevice* selectDevice(const String& group, DeviceGroup::Policy policy);
+
+    /**
+     * Update the IMEI and IMSI a device is found by, call with the device
+     *  locked whenever they change. Also attaches the budget of the SIM
+     * @param dev - device to index
+     */
+    void indexDevice(CardDevice* dev);
+
+    /**
+     * Load the SIM budgets saved by a previous run, once at startup
+     * @param file - file the budgets are kept in
+     */
+    void loadBudgets(const String& file);
+
+    /**
+     * Count an SMS part accepted by the modem, saved later
+     * @param budget - budget of the SIM that sent it
+     */
+    void chargeSMS(SIMBudget* budget);
+
+    /**
+     * Count the duration of an outgoing call, saved later
+     * @param budget - budget of the SIM that placed it
+     * @param seconds - call duration
+     */
+    void chargeCall(SIMBudget* budget, unsigned int seconds);
+
+    /**
+     * Save the SIM budgets if they changed
+     */
+    void saveBudgets();
+
     /**
      * Remove all devices from endpoint
      * @param
@@ -911,6 +1820,52 @@ public:
      */
     String devicesStatus();
 
+    /**
+     * Get I/O statistics of all devices
+     * @param
+     * @return
+     */
+    String devicesStats();
+
+    /**
+     * Start reactor threads serving data ttys of all devices
+     * @param count - number of threads, 0 to use one thread per device
+     * @return count of started threads
+     */
+    unsigned int startReactors(unsigned int count);
+
+    /**
+     * Stop reactor threads and wait until they are gone, without holding
+     *  the endpoint lock. Devices must be disconnected first, the threads
+     *  may still serve them until they exit
+     */
+    void stopReactors();
+
+    /**
+     * Count a reactor thread as gone, called by its destructor
+     */
+    void reactorGone();
+
+    /**
+     * Start threads serving audio ttys of all devices
+     * @param count - number of threads, 0 to use one thread per device
+     * @param pin - pin each thread to a cpu core
+     * @return count of started threads
+     */
+    unsigned int startMediaReactors(unsigned int count, bool pin);
+
+    /**
+     * Pick media thread for newly connected device
+     * @return least loaded media reactor or NULL if media threads are not pooled
+     */
+    MediaReactor* mediaReactor();
+
+    /**
+     * Pick reactor for newly connected device
+     * @return least loaded reactor or NULL if not in reactor mode
+     */
+    ATReactor* reactor();
+
     /**
      * Called on new incoming for call
      * @param dev - pointer to calling device
@@ -924,6 +1879,80 @@ private:
     ObjList m_devices; //devices list
     int m_interval;  //discovery interval
     bool m_run;
+    ATReactor** m_reactors;
+    unsigned int m_reactorCount;
+    MediaReactor** m_mediaReactors;
+    unsigned int m_mediaReactorCount;
+    Mutex m_reactorMutex;
+    unsigned int m_reactorsLive;	//reactor threads not deleted yet
+
+    // Device lookups take only m_indexMutex and never wait for discovery
+    Mutex m_indexMutex;
+    HashList m_byName;
+    HashList m_byImei;
+    HashList m_byImsi;
+    ObjList m_groups;
+
+    // SIM budgets live as long as the endpoint, devices only point to them
+    Mutex m_budgetMutex;
+    HashList m_budgets;
+    String m_budgetFile;
+    unsigned int m_budgetDay;
+    bool m_budgetDirty;
+    unsigned int m_budgetSaved;	//sec of last save
+
+    // Hot plug watches, used only by the endpoint thread
+    int m_watchFd;		//inotify descriptor, -1 when polling only
+    ObjList m_watches;
+    bool m_rewatch;		//devices or directories changed, watch again, under m_mutex
+
+    /**
+     * Watch the directories of all device ttys. A directory that does not
+     *  exist yet is picked up when its parent gets it
+     */
+    void rewatch();
+
+    /**
+     * Sleep for a discovery tick, connecting devices whose ttys show up
+     * @param msec - time to sleep
+     */
+    void hotplugWait(unsigned int msec);
+
+    /**
+     * Read pending inotify events and connect the devices they concern
+     */
+    void hotplugEvents();
+
+    /**
+     * Hand over reassembled messages that are due, from the endpoint thread.
+     * Devices are locked to get their params so none may be held here
+     * @param all - hand over all of them, the devices are going away
+     */
+    void flushSMS(bool all);
+
+    /**
+     * Disconnect all devices, each under its lock
+     */
+    void disconnectDevices();
+
+    /**
+     * Let every device send from its SMS spool, from the endpoint thread.
+     * Picks up rate limits and retries that came due and devices that
+     * registered again
+     */
+    void pumpSMS();
+
+    /**
+     * Reset SIM budgets on a new day and save them now and then, from the
+     *  endpoint thread
+     */
+    void checkBudgets();
+
+    Mutex m_smsMutex;
+    ObjList m_smsParts;	//incomplete incoming SMS, oldest first
+    unsigned int m_smsBytes;	//text kept in m_smsParts
+    unsigned int m_smsTimeout;	//msec
+    unsigned int m_smsMemory;
 };
 
 #endif
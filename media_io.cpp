@@ -0,0 +1,392 @@
+/**
+ * media_io.cpp
+ * This file is part of the Yate-datacard Project http://code.google.com/p/yate-datacard/
+ * Yate datacard channel driver for Huawei UMTS modem
+ *
+ * Copyright (C) 2010-2011 MBloody
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include "datacarddevice.h"
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+
+//AudioRing
+AudioRing::AudioRing()
+    : m_overflows(0), m_buf(0), m_size(0), m_head(0), m_tail(0)
+{
+}
+
+AudioRing::~AudioRing()
+{
+    delete[] m_buf;
+}
+
+void AudioRing::resize(unsigned int size)
+{
+    unsigned int n = 1;
+    while (n < size)
+	n <<= 1;
+    delete[] m_buf;
+    m_buf = new char[n];
+    m_size = n;
+    m_head = m_tail = 0;
+}
+
+unsigned int AudioRing::put(const char* data, unsigned int len)
+{
+    unsigned int head = m_head;
+    unsigned int room = m_size - (head - m_tail);
+    // Do not fill the slots before we know the consumer is done with them
+    __sync_synchronize();
+    if (len > room)
+    {
+	m_overflows++;
+	len = room;
+    }
+    if (!len)
+	return 0;
+    unsigned int pos = head & (m_size - 1);
+    unsigned int first = m_size - pos;
+    if (first > len)
+	first = len;
+    memcpy(m_buf + pos, data, first);
+    memcpy(m_buf, data + first, len - first);
+    // Publish data before moving the head
+    __sync_synchronize();
+    m_head = head + len;
+    return len;
+}
+
+unsigned int AudioRing::get(char* data, unsigned int len)
+{
+    unsigned int head = m_head;
+    __sync_synchronize();
+    unsigned int tail = m_tail;
+    if (len > head - tail)
+	len = head - tail;
+    if (len)
+    {
+	unsigned int pos = tail & (m_size - 1);
+	unsigned int first = m_size - pos;
+	if (first > len)
+	    first = len;
+	memcpy(data, m_buf + pos, first);
+	memcpy(data + first, m_buf, len - first);
+    }
+    // Release the slots only after we copied them
+    __sync_synchronize();
+    m_tail = tail + len;
+    return len;
+}
+
+void AudioRing::skip(unsigned int len)
+{
+    unsigned int tail = m_tail;
+    if (len > m_head - tail)
+	len = m_head - tail;
+    __sync_synchronize();
+    m_tail = tail + len;
+}
+
+
+//JitterBuffer
+JitterBuffer::JitterBuffer()
+    : m_late(0), m_concealed(0), m_underruns(0), m_dropped(0),
+    m_resync(false), m_started(false), m_nextStamp(0),
+    m_reset(false), m_buffering(true), m_min(0), m_max(0), m_target(0),
+    m_lowWater(0), m_ticks(0), m_underrun(false), m_lateSeen(0)
+{
+}
+
+void JitterBuffer::configure(unsigned int minDelay, unsigned int maxDelay, unsigned int size)
+{
+    m_min = (minDelay + FRAME_MSEC - 1) / FRAME_MSEC * FRAME_SIZE;
+    if (m_min < FRAME_SIZE)
+	m_min = FRAME_SIZE;
+    m_max = (maxDelay + FRAME_MSEC - 1) / FRAME_MSEC * FRAME_SIZE;
+    if (m_max < m_min + FRAME_SIZE)
+	m_max = m_min + FRAME_SIZE;
+    // Room for a burst on top of the capped delay
+    if (size < 2 * m_max)
+	size = 2 * m_max;
+    m_ring.resize(size);
+    m_target = m_min;
+    m_started = false;
+    m_buffering = true;
+    m_resync = m_reset = false;
+}
+
+unsigned int JitterBuffer::put(const char* data, unsigned int len, unsigned long tStamp)
+{
+    static const char silence[FRAME_SIZE] = { 0 };
+
+    if (m_resync)
+    {
+	m_resync = false;
+	m_started = false;
+    }
+    len &= ~1U;
+    if (!len)
+	return 0;
+
+    if (m_started && tStamp != DataNode::invalidStamp())
+    {
+	long diff = (long)(tStamp - m_nextStamp);
+	if (diff < 0)
+	{
+	    // Part or all of it should have been played already
+	    unsigned long late = 2 * (unsigned long)(-diff);
+	    if (late >= len)
+	    {
+		m_late++;
+		return 0;
+	    }
+	    data += late;
+	    len -= late;
+	    tStamp = m_nextStamp;
+	}
+	else if (diff > 0)
+	{
+	    // Lost audio, keep timing with silence. A jump past the cap is a new stream
+	    unsigned long gap = 2 * (unsigned long)diff;
+	    if (gap <= m_max)
+	    {
+		m_concealed++;
+		while (gap)
+		{
+		    unsigned int n = gap > FRAME_SIZE ? FRAME_SIZE : gap;
+		    m_ring.put(silence, n);
+		    gap -= n;
+		}
+	    }
+	}
+    }
+    if (tStamp != DataNode::invalidStamp())
+    {
+	m_nextStamp = tStamp + len / 2;
+	m_started = true;
+    }
+    return m_ring.put(data, len);
+}
+
+unsigned int JitterBuffer::get(char* frame)
+{
+    if (m_reset)
+    {
+	m_reset = false;
+	m_ring.skip(m_ring.avail());
+	m_target = m_min;
+	m_buffering = true;
+	m_ticks = 0;
+	m_underrun = false;
+    }
+
+    unsigned int avail = m_ring.avail();
+    if (m_late != m_lateSeen)
+    {
+	// Audio arrives later than we play it, buffer deeper
+	m_lateSeen = m_late;
+	m_underrun = true;
+	if (m_target + FRAME_SIZE < m_max)
+	    m_target += FRAME_SIZE;
+	if (avail < m_target)
+	    m_buffering = true;
+    }
+    if (m_buffering)
+    {
+	// Build up the target delay before starting playout
+	if (avail < m_target)
+	    return 0;
+	m_buffering = false;
+	m_lowWater = avail;
+	m_ticks = 0;
+	m_underrun = false;
+    }
+
+    if (avail > m_max)
+    {
+	// Latency cap, fall back to target delay
+	unsigned int drop = (avail - m_target) / FRAME_SIZE * FRAME_SIZE;
+	m_ring.skip(drop);
+	m_dropped += drop / FRAME_SIZE;
+	avail -= drop;
+    }
+    if (avail < m_lowWater)
+	m_lowWater = avail;
+
+    unsigned int len = m_ring.get(frame, FRAME_SIZE);
+    if (len < FRAME_SIZE)
+    {
+	// Ran dry, play out what we have and buffer deeper
+	m_underruns++;
+	m_underrun = true;
+	m_buffering = true;
+	if (m_target + FRAME_SIZE < m_max)
+	    m_target += FRAME_SIZE;
+	return len;
+    }
+
+    if (++m_ticks >= JB_WINDOW)
+    {
+	// A quiet window lowers the target, then excess delay is dropped a frame at a time
+	if (!m_underrun && m_target > m_min)
+	    m_target -= FRAME_SIZE;
+	if (m_lowWater >= m_target + FRAME_SIZE)
+	{
+	    m_ring.skip(FRAME_SIZE);
+	    m_dropped++;
+	}
+	m_lowWater = m_ring.avail();
+	m_ticks = 0;
+	m_underrun = false;
+    }
+    return len;
+}
+
+
+//MediaReactor
+MediaReactor::MediaReactor(DevicesEndPoint* owner, unsigned int index, unsigned int slots, bool pin)
+    : Thread("MediaReactor", Thread::High), m_owner(owner), m_index(index), m_epoll(-1), m_running(true), m_pin(pin),
+    m_mutex(false), m_slots(0), m_size(slots), m_used(0)
+{
+    if (!m_size)
+	m_size = 1;
+    m_slots = new MediaSlot[m_size];
+    memset(m_slots, 0, m_size * sizeof(MediaSlot));
+    m_epoll = epoll_create(m_size);
+    if (m_epoll < 0)
+	Debug(DebugWarn, "MediaReactor %u: epoll_create() error: %d", m_index, errno);
+}
+
+MediaReactor::~MediaReactor()
+{
+    m_owner->reactorGone();
+    if (m_epoll >= 0)
+	close(m_epoll);
+    delete[] m_slots;
+}
+
+bool MediaReactor::attach(CardDevice* dev)
+{
+    Lock lock(m_mutex);
+    unsigned int i = 0;
+    while (i < m_size && m_slots[i].dev)
+	i++;
+    if (i >= m_size)
+    {
+	Debug(DebugWarn, "MediaReactor %u: no free slot for [%s]", m_index, dev->c_str());
+	return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, dev->m_audio_fd, &ev) < 0)
+    {
+	Debug(DebugAll, "MediaReactor %u: can't watch [%s]: %d", m_index, dev->c_str(), errno);
+	return false;
+    }
+    m_slots[i].dev = dev;
+    m_used++;
+    Debug(DebugAll, "MediaReactor %u: serving [%s] in slot %u, %u devices", m_index, dev->c_str(), i, m_used);
+    return true;
+}
+
+void MediaReactor::detach(CardDevice* dev)
+{
+    // Must be called before the tty is closed
+    if (dev->m_audio_fd >= 0)
+	epoll_ctl(m_epoll, EPOLL_CTL_DEL, dev->m_audio_fd, 0);
+    Lock lock(m_mutex);
+    for (unsigned int i = 0; i < m_size; i++)
+    {
+	if (m_slots[i].dev != dev)
+	    continue;
+	m_slots[i].dev = 0;
+	m_used--;
+	break;
+    }
+}
+
+unsigned int MediaReactor::load()
+{
+    Lock lock(m_mutex);
+    return m_used;
+}
+
+void MediaReactor::stop()
+{
+    m_running = false;
+}
+
+void MediaReactor::pin()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus <= 0)
+	return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(m_index % cpus, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err)
+	Debug(DebugMild, "MediaReactor %u: can't pin to cpu %ld: %d", m_index, m_index % cpus, err);
+    else
+	Debug(DebugAll, "MediaReactor %u: pinned to cpu %ld", m_index, m_index % cpus);
+}
+
+void MediaReactor::run()
+{
+    struct epoll_event events[DC_REACTOR_EVENTS];
+    char buf[FRAME_SIZE];
+
+    if (m_pin)
+	pin();
+
+    while (m_running)
+    {
+	int n = epoll_wait(m_epoll, events, DC_REACTOR_EVENTS, 1000);
+	if (n < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    Debug(DebugWarn, "MediaReactor %u: epoll_wait() error: %d", m_index, errno);
+	    Thread::msleep(DC_REACTOR_TICK);
+	    continue;
+	}
+	for (int i = 0; i < n; i++)
+	{
+	    // No lock per frame, a detached device drops out on the next event
+	    unsigned int idx = events[i].data.u32;
+	    CardDevice* dev = (idx < m_size) ? m_slots[idx].dev : 0;
+	    if (!dev)
+		continue;
+
+	    if (events[i].events & EPOLLIN)
+		dev->processAudio(buf);
+	    else
+	    {
+		Debug(DebugAll, "MediaReactor exception datacard [%s]", dev->c_str());
+		Lock lock(dev->m_mutex);
+		dev->disconnect();
+	    }
+	}
+    }
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -14,23 +14,502 @@ Either version 2 of the License, or (at your option) any later version.
 #include <string.h>
 #include <ctype.h>
 #include <iconv.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "pdu.h"
 
 
 // Global constants. FIXME: set correct values
-const int max_number = 64;
-const int max_number_type = 1024;
-const int max_smsc = 64;
-const int max_date = 32;
-const int max_time = 32;
-const int max_udh_data = 512;
-const int max_udh_type = 512;
-const int max_err = 1024;
-const int maxsms_binary = 140;
-const int max_message = maxsms_binary * 4;
 const int validity_period = 255;
+// Septets in the user data of a single SMS
 const int max_pdu = 160;
 
+// Conversion descriptors of one thread. We only convert between a handful
+// of charset pairs, iconv_open() loading the gconv modules each time costs
+// far more than the conversion itself
+const int max_iconv_cached = 8;
+
+struct IconvCache {
+    int count;
+    struct {
+        char tocode[16];
+        char fromcode[16];
+        iconv_t cd;
+    } entry[max_iconv_cached];
+};
+
+static pthread_key_t s_iconv_key;
+static pthread_once_t s_iconv_once = PTHREAD_ONCE_INIT;
+
+static void iconv_cache_free(void* data)
+{
+    IconvCache* cache = (IconvCache*)data;
+    for (int i = 0; i < cache->count; i++)
+        iconv_close(cache->entry[i].cd);
+    free(cache);
+}
+
+static void iconv_cache_init()
+{
+    pthread_key_create(&s_iconv_key, iconv_cache_free);
+}
+
+iconv_t iconv_cached(const char* tocode, const char* fromcode)
+{
+    pthread_once(&s_iconv_once, iconv_cache_init);
+    IconvCache* cache = (IconvCache*)pthread_getspecific(s_iconv_key);
+    if (!cache)
+    {
+        cache = (IconvCache*)calloc(1, sizeof(IconvCache));
+        if (!cache)
+            return (iconv_t)(-1);
+        pthread_setspecific(s_iconv_key, cache);
+    }
+
+    for (int i = 0; i < cache->count; i++)
+    {
+        if (strcmp(cache->entry[i].tocode, tocode) || strcmp(cache->entry[i].fromcode, fromcode))
+            continue;
+        iconv(cache->entry[i].cd, NULL, NULL, NULL, NULL);
+        return cache->entry[i].cd;
+    }
+
+    if (cache->count >= max_iconv_cached
+        || strlen(tocode) >= sizeof(cache->entry[0].tocode)
+        || strlen(fromcode) >= sizeof(cache->entry[0].fromcode))
+        return (iconv_t)(-1);
+    iconv_t cd = iconv_open(tocode, fromcode);
+    if (cd == (iconv_t)(-1))
+        return cd;
+    strcpy(cache->entry[cache->count].tocode, tocode);
+    strcpy(cache->entry[cache->count].fromcode, fromcode);
+    cache->entry[cache->count].cd = cd;
+    cache->count++;
+    return cd;
+}
+
+// Hex dump codec. The PDU is nothing but hex digits and long UCS2 messages
+// or USSD menus go through here a few hundred digits at a time.
+static const char s_hex[] = "0123456789ABCDEF";
+
+// Value of a hex digit, -1 for anything else
+static const signed char s_hexval[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+// Write one octet as two hex digits, return the position after them
+static inline char* bin2octet(char* dest, int value)
+{
+    dest[0] = s_hex[(value >> 4) & 0x0f];
+    dest[1] = s_hex[value & 0x0f];
+    return dest + 2;
+}
+
+#ifdef __SSE2__
+// Values of 16 hex digits and a bit mask of the valid ones
+static inline __m128i sse2_hexval(__m128i c, int* valid)
+{
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i is_d = _mm_and_si128(_mm_cmpgt_epi8(d, _mm_set1_epi8(-1)),
+        _mm_cmplt_epi8(d, _mm_set1_epi8(10)));
+    // Both cases of A-F, what wraps below 'a' turns negative
+    __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_l = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8(-1)),
+        _mm_cmplt_epi8(l, _mm_set1_epi8(6)));
+    *valid = _mm_movemask_epi8(_mm_or_si128(is_d, is_l));
+    return _mm_or_si128(_mm_and_si128(is_d, d),
+        _mm_and_si128(is_l, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+// Join the nibble pairs of 16 digit values into 8 octets, one per 16 bit lane
+static inline __m128i sse2_nibbles2octets(__m128i n)
+{
+    return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(n, 4), _mm_set1_epi16(0x00f0)),
+        _mm_srli_epi16(n, 8));
+}
+
+// Upper case hex digits of 16 nibbles
+static inline __m128i sse2_hexdigits(__m128i n)
+{
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8(7));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letter);
+}
+#endif
+
+int hex2bin(unsigned char* binary, const char* hex, int length)
+{
+    int octets = length / 2;
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= octets; i += 16)
+    {
+        int valid0, valid1;
+        __m128i n0 = sse2_hexval(_mm_loadu_si128((const __m128i*)(hex + 2 * i)), &valid0);
+        __m128i n1 = sse2_hexval(_mm_loadu_si128((const __m128i*)(hex + 2 * i + 16)), &valid1);
+        if ((valid0 & valid1) != 0xffff)
+            return -1;
+        _mm_storeu_si128((__m128i*)(binary + i),
+            _mm_packus_epi16(sse2_nibbles2octets(n0), sse2_nibbles2octets(n1)));
+    }
+#endif
+    for (; i < octets; i++)
+    {
+        int hi = s_hexval[(unsigned char)hex[2 * i]];
+        int lo = s_hexval[(unsigned char)hex[2 * i + 1]];
+        if ((hi | lo) < 0)
+            return -1;
+        binary[i] = (hi << 4) | lo;
+    }
+    return octets;
+}
+
+char* bin2hex(char* hex, const unsigned char* binary, int length)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i*)(binary + i));
+        __m128i hi = sse2_hexdigits(_mm_and_si128(_mm_srli_epi16(b, 4), _mm_set1_epi8(0x0f)));
+        __m128i lo = sse2_hexdigits(_mm_and_si128(b, _mm_set1_epi8(0x0f)));
+        _mm_storeu_si128((__m128i*)hex, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+        hex += 32;
+    }
+#endif
+    for (; i < length; i++)
+        hex = bin2octet(hex, binary[i]);
+    return hex;
+}
+
+// GSM 03.38 default alphabet. Septets of the default table to Unicode, the
+// escape 0x1B reads as a no-break space when nothing follows it
+static const unsigned short s_gsm2ucs[128] = {
+    0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+    0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+    0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+    0x03A3, 0x0398, 0x039E, 0x00A0, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+    0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0,
+};
+
+// Characters of the extension table, each sent as 0x1B and the septet
+static const struct {
+    unsigned char gsm;
+    unsigned short ucs;
+} s_gsmext[] = {
+    { 0x0A, 0x000C },
+    { 0x14, 0x005E },
+    { 0x28, 0x007B },
+    { 0x29, 0x007D },
+    { 0x2F, 0x005C },
+    { 0x3C, 0x005B },
+    { 0x3D, 0x007E },
+    { 0x3E, 0x005D },
+    { 0x40, 0x007C },
+    { 0x65, 0x20AC },
+};
+
+// ASCII to septets, 0x100 flags an extension table septet, -1 has no
+// GSM representation
+static const short s_ascii2gsm[128] = {
+       -1,    -1,    -1,    -1,    -1,    -1,    -1,    -1,
+       -1,    -1, 0x00A,    -1, 0x10A, 0x00D,    -1,    -1,
+       -1,    -1,    -1,    -1,    -1,    -1,    -1,    -1,
+       -1,    -1,    -1,    -1,    -1,    -1,    -1,    -1,
+    0x020, 0x021, 0x022, 0x023, 0x002, 0x025, 0x026, 0x027,
+    0x028, 0x029, 0x02A, 0x02B, 0x02C, 0x02D, 0x02E, 0x02F,
+    0x030, 0x031, 0x032, 0x033, 0x034, 0x035, 0x036, 0x037,
+    0x038, 0x039, 0x03A, 0x03B, 0x03C, 0x03D, 0x03E, 0x03F,
+    0x000, 0x041, 0x042, 0x043, 0x044, 0x045, 0x046, 0x047,
+    0x048, 0x049, 0x04A, 0x04B, 0x04C, 0x04D, 0x04E, 0x04F,
+    0x050, 0x051, 0x052, 0x053, 0x054, 0x055, 0x056, 0x057,
+    0x058, 0x059, 0x05A, 0x13C, 0x12F, 0x13E, 0x114, 0x011,
+       -1, 0x061, 0x062, 0x063, 0x064, 0x065, 0x066, 0x067,
+    0x068, 0x069, 0x06A, 0x06B, 0x06C, 0x06D, 0x06E, 0x06F,
+    0x070, 0x071, 0x072, 0x073, 0x074, 0x075, 0x076, 0x077,
+    0x078, 0x079, 0x07A, 0x128, 0x140, 0x129, 0x13D,    -1,
+};
+
+// The rest of the alphabet sorted by Unicode for a binary search
+static const struct {
+    unsigned short ucs;
+    unsigned short gsm;
+} s_ucs2gsm[] = {
+    { 0x00A1, 0x040 },
+    { 0x00A3, 0x001 },
+    { 0x00A4, 0x024 },
+    { 0x00A5, 0x003 },
+    { 0x00A7, 0x05F },
+    { 0x00BF, 0x060 },
+    { 0x00C4, 0x05B },
+    { 0x00C5, 0x00E },
+    { 0x00C6, 0x01C },
+    { 0x00C7, 0x009 },
+    { 0x00C9, 0x01F },
+    { 0x00D1, 0x05D },
+    { 0x00D6, 0x05C },
+    { 0x00D8, 0x00B },
+    { 0x00DC, 0x05E },
+    { 0x00DF, 0x01E },
+    { 0x00E0, 0x07F },
+    { 0x00E4, 0x07B },
+    { 0x00E5, 0x00F },
+    { 0x00E6, 0x01D },
+    { 0x00E8, 0x004 },
+    { 0x00E9, 0x005 },
+    { 0x00EC, 0x007 },
+    { 0x00F1, 0x07D },
+    { 0x00F2, 0x008 },
+    { 0x00F6, 0x07C },
+    { 0x00F8, 0x00C },
+    { 0x00F9, 0x006 },
+    { 0x00FC, 0x07E },
+    { 0x0393, 0x013 },
+    { 0x0394, 0x010 },
+    { 0x0398, 0x019 },
+    { 0x039B, 0x014 },
+    { 0x039E, 0x01A },
+    { 0x03A0, 0x016 },
+    { 0x03A3, 0x018 },
+    { 0x03A6, 0x012 },
+    { 0x03A8, 0x017 },
+    { 0x03A9, 0x015 },
+    { 0x20AC, 0x165 },
+};
+
+// Decode the UTF-8 character at *utf8 and advance past it.
+// Returns the code point or -1 for a broken sequence: stray continuation
+// or invalid lead byte, truncated, overlong, surrogate or above U+10FFFF
+static int utf8char(const unsigned char** utf8, const unsigned char* end)
+{
+    const unsigned char* p = *utf8;
+    int c = *p++;
+    if (c < 0x80)
+    {
+        *utf8 = p;
+        return c;
+    }
+    if (c < 0xc0 || c >= 0xf8)
+    {
+        *utf8 = p;
+        return -1;
+    }
+    int more = (c >= 0xf0) ? 3 : (c >= 0xe0) ? 2 : 1;
+    static const int s_min[4] = { 0, 0x80, 0x800, 0x10000 };
+    int min = s_min[more];
+    c &= 0x3f >> more;
+    for (; more && p < end && (*p & 0xc0) == 0x80; more--)
+        c = (c << 6) | (*p++ & 0x3f);
+    *utf8 = p;
+    if (more || c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+        return -1;
+    return c;
+}
+
+// Map one UTF-8 character at *utf8 to a septet, 0x100 flagged for the
+// extension table, -1 if there is none. Advances *utf8 past the character
+static int utf8char2gsm(const unsigned char** utf8, const unsigned char* end)
+{
+    int c = utf8char(utf8, end);
+    if (c < 0x80)
+        return (c < 0) ? -1 : s_ascii2gsm[c];
+    int lo = 0;
+    int hi = sizeof(s_ucs2gsm) / sizeof(s_ucs2gsm[0]) - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (s_ucs2gsm[mid].ucs == (unsigned int)c)
+            return s_ucs2gsm[mid].gsm;
+        if (s_ucs2gsm[mid].ucs < (unsigned int)c)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+int utf8_gsm_septets(const char* utf8, int length)
+{
+    const unsigned char* p = (const unsigned char*)utf8;
+    const unsigned char* end = p + ((length < 0) ? strlen(utf8) : length);
+    int septets = 0;
+    while (p < end)
+    {
+        int gsm = utf8char2gsm(&p, end);
+        if (gsm < 0)
+            return -1;
+        septets += (gsm & 0x100) ? 2 : 1;
+    }
+    return septets;
+}
+
+int utf8_to_gsm(unsigned char* septets, int size, const char* utf8, int length, int replace)
+{
+    const unsigned char* p = (const unsigned char*)utf8;
+    const unsigned char* end = p + ((length < 0) ? strlen(utf8) : length);
+    int count = 0;
+    while (p < end)
+    {
+        int gsm = utf8char2gsm(&p, end);
+        if (gsm < 0)
+        {
+            if (replace < 0)
+                return -1;
+            gsm = replace;
+        }
+        if (count + ((gsm & 0x100) ? 2 : 1) > size)
+            return -1;
+        if (gsm & 0x100)
+            septets[count++] = 0x1B;
+        septets[count++] = gsm & 0x7f;
+    }
+    return count;
+}
+
+// Append the UTF-8 of c, return the position after it or 0 if it does not fit
+static inline char* ucs2utf8(char* dest, const char* end, unsigned int c)
+{
+    if (c < 0x80)
+    {
+        if (dest >= end)
+            return 0;
+        *dest++ = c;
+    }
+    else if (c < 0x800)
+    {
+        if (dest + 1 >= end)
+            return 0;
+        *dest++ = 0xc0 | (c >> 6);
+        *dest++ = 0x80 | (c & 0x3f);
+    }
+    else
+    {
+        if (dest + 2 >= end)
+            return 0;
+        *dest++ = 0xe0 | (c >> 12);
+        *dest++ = 0x80 | ((c >> 6) & 0x3f);
+        *dest++ = 0x80 | (c & 0x3f);
+    }
+    return dest;
+}
+
+int gsm_to_utf8(char* utf8, int size, const unsigned char* septets, int length)
+{
+    char* p = utf8;
+    const char* end = utf8 + size - 1;
+    for (int i = 0; i < length && p; i++)
+    {
+        unsigned int c = s_gsm2ucs[septets[i] & 0x7f];
+        if (septets[i] == 0x1B && i + 1 < length)
+        {
+            // Unknown extensions show the default table character
+            i++;
+            c = s_gsm2ucs[septets[i] & 0x7f];
+            for (unsigned int e = 0; e < sizeof(s_gsmext) / sizeof(s_gsmext[0]); e++)
+                if (s_gsmext[e].gsm == septets[i])
+                {
+                    c = s_gsmext[e].ucs;
+                    break;
+                }
+        }
+        p = ucs2utf8(p, end, c);
+    }
+    if (!p)
+        return -1;
+    *p = '\0';
+    return p - utf8;
+}
+
+int gsm_pack(unsigned char* octets, const unsigned char* septets, int length, int fill)
+{
+    unsigned char* o = octets;
+    unsigned long long acc = 0;
+    int bits = fill;
+    int i = 0;
+    // Whole words: 8 septets make 7 octets, the fill bits carry over
+    for (; i + 8 <= length; i += 8)
+    {
+        unsigned long long word = 0;
+        for (int j = 0; j < 8; j++)
+            word |= (unsigned long long)(septets[i + j] & 0x7f) << (7 * j);
+        acc |= word << bits;
+        for (int j = 0; j < 7; j++)
+        {
+            *o++ = acc & 0xff;
+            acc >>= 8;
+        }
+    }
+    for (; i < length; i++)
+    {
+        acc |= (unsigned long long)(septets[i] & 0x7f) << bits;
+        bits += 7;
+        if (bits >= 8)
+        {
+            *o++ = acc & 0xff;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+    if (bits > 0)
+        *o++ = acc & 0xff;
+    return o - octets;
+}
+
+void gsm_unpack(unsigned char* septets, const unsigned char* octets, int length)
+{
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        unsigned long long word = 0;
+        for (int j = 0; j < 7; j++)
+            word |= (unsigned long long)octets[j] << (8 * j);
+        octets += 7;
+        for (int j = 0; j < 8; j++)
+            septets[i + j] = (word >> (7 * j)) & 0x7f;
+    }
+    unsigned int acc = 0;
+    int bits = 0;
+    for (; i < length; i++)
+    {
+        if (bits < 7)
+        {
+            acc |= *octets++ << bits;
+            bits += 8;
+        }
+        septets[i] = acc & 0x7f;
+        acc >>= 7;
+        bits -= 7;
+    }
+}
+
 // Utility functions
 // TODO: remove it!
 char *strcpyo(char *dest, const char *src)
@@ -48,31 +527,20 @@ char *strcpyo(char *dest, const char *src)
 // Converts an octet to a 8-Bit value
 int octet2bin(const char* octet) 
 {
-    int result = 0;
-    if (octet[0] > 57)
-        result += octet[0] - 55;
-    else
-        result += octet[0] - 48;
-    result = result << 4;
-    if (octet[1] > 57)
-        result += octet[1] - 55;
-    else
-        result += octet[1] - 48;
-    return result;
+    return ((s_hexval[(unsigned char)octet[0]] & 0x0f) << 4)
+        | (s_hexval[(unsigned char)octet[1]] & 0x0f);
 }
 
 // Converts an octet to a 8bit value, returns < in case of error.
 int octet2bin_check(const char *octet)
 {
-    if (octet[0] == 0)
-        return -1;
-    if (octet[1] == 0)
-        return -2;
-    if (!isxdigit(octet[0]))
-        return -3;
-    if (!isxdigit(octet[1]))
-        return -4;
-    return octet2bin(octet);
+    int hi = s_hexval[(unsigned char)octet[0]];
+    if (hi < 0)
+        return octet[0] ? -3 : -1;
+    int lo = s_hexval[(unsigned char)octet[1]];
+    if (lo < 0)
+        return octet[1] ? -4 : -2;
+    return (hi << 4) | lo;
 }
 
 // Swap every second character
@@ -348,7 +816,22 @@ int pdu2text(const char *pdu, char *text, int *text_length, int *expected_length
     octets = (septets *7 +7) /8;     
     bitposition = 0;
     octetcounter = 0;
-    for (charcounter = 0; charcounter < septets; charcounter++)
+    charcounter = 0;
+
+    // All octets there and valid: decode them at once and unpack the septets,
+    // else go the slow way below which locates the error
+    unsigned char data[256];
+    if (strnlen(pdu + 2, octets * 2) == (size_t)(octets * 2)
+        && hex2bin(data, pdu + 2, octets * 2) == octets)
+    {
+        unsigned char chars[256];
+        gsm_unpack(chars, data, septets);
+        if (septets > skip_characters)
+            memcpy(text, chars + skip_characters, septets - skip_characters);
+        charcounter = septets;
+    }
+
+    for (; charcounter < septets; charcounter++)
     {
         c = 0;
         for (bitcounter = 0; bitcounter < 7; bitcounter++)
@@ -472,7 +955,15 @@ int pdu2binary(const char* pdu, char* binary, int *data_length,
 
     *expected_length = octets -skip_octets;
 
-    for (octetcounter = 0; octetcounter < octets - skip_octets; octetcounter++)
+    // Fast path when all octets are there and valid
+    octetcounter = 0;
+    const char* data = pdu +2 +(skip_octets *2);
+    int data_hex = (octets - skip_octets) *2;
+    if (data_hex > 0 && strnlen(data, data_hex) == (size_t)data_hex
+        && hex2bin((unsigned char*)binary, data, data_hex) == octets - skip_octets)
+        octetcounter = octets - skip_octets;
+
+    for (; octetcounter < octets - skip_octets; octetcounter++)
     {
         if ((i = octet2bin_check(pdu +(octetcounter << 1) +2 +(skip_octets *2))) < 0)
         {
@@ -492,210 +983,111 @@ int pdu2binary(const char* pdu, char* binary, int *data_length,
     return octets -skip_octets;
 }
 
-// Converts an ascii text to a pdu string 
-// text might contain zero values because this is a valid character code in sms
-// character set. Therefore we need the length parameter.
-// If udh is not 0, then insert it to the beginning of the message.
-// The string must be in hex-dump format: "05 00 03 AF 02 01". 
-// The first byte is the size of the UDH.
-int text2pdu(char* text, int length, char* pdu, char* udh)
+// Write digits as swapped semi-octets, odd count is padded with F
+static char* digits2octets(char* dest, const char* digits, int length)
 {
-    char tmp[500];
-    char octett[10];
-    int pdubitposition;
-    int pdubyteposition = 0;
-    int character;
-    int bit;
-    int pdubitnr;
-    int counted_characters = 0;
-    int udh_size_octets;   // size of the udh in octets, should equal to the first byte + 1
-    int udh_size_septets;  // size of udh in septets (7bit text characters)
-    int fillbits;          // number of filler bits between udh and ud.
-    int counter;
-
-    pdu[0]=0;
-    // Check the udh
-    if (udh)
-    {
-        udh_size_octets = (strlen(udh) + 2) / 3;
-        udh_size_septets = ((udh_size_octets) * 8 + 6) / 7;
-        fillbits = 7 - (udh_size_octets % 7);
-        if (fillbits == 7)
-            fillbits = 0;
-
-        // copy udh to pdu, skipping the space characters
-        for (counter = 0; counter < udh_size_octets; counter++)
-        {
-            pdu[counter * 2] = udh[counter * 3];
-            pdu[counter * 2 + 1] = udh[counter * 3 + 1];
-        }
-        pdu[counter * 2] = 0;
-    } 
-    else
+    for (int i = 0; i < length; i += 2)
     {
-        udh_size_octets = 0;
-        udh_size_septets = 0; 
-        fillbits = 0;
-    }
-    // limit size of the message to maximum allowed size
-    if (length > max_pdu - udh_size_septets)
-    length = max_pdu - udh_size_septets;
-    //clear the tmp buffer
-    for (character = 0; (size_t)character < sizeof(tmp); character++)
-        tmp[character] = 0;
-    // Convert 8bit text stream to 7bit stream
-    for (character = 0; character < length; character++)
-    {
-        counted_characters++;
-        for (bit = 0; bit < 7; bit++)
-        {
-            pdubitnr= 7 * character + bit + fillbits;
-            pdubyteposition = pdubitnr / 8;
-            pdubitposition = pdubitnr % 8;
-            if (text[character] & (1 << bit))
-                tmp[pdubyteposition] = tmp[pdubyteposition] | (1 << pdubitposition);
-            else
-                tmp[pdubyteposition] = tmp[pdubyteposition] & ~(1 << pdubitposition);
-        }
+        *dest++ = (i + 1 < length) ? digits[i + 1] : 'F';
+        *dest++ = digits[i];
     }
-    tmp[pdubyteposition + 1] = 0;
-    // convert 7bit stream to hex-dump
-    for (character = 0; character <= pdubyteposition; character++)
+    return dest;
+}
+
+// Read a hex dump with or without spaces ("05 00 03 AF 02 01") into octets.
+// Returns the number of octets, -1 on invalid character or overflow.
+static int hexdump2bin(const char* hex, unsigned char* binary, int size)
+{
+    int length = 0;
+    while (*hex)
     {
-        sprintf(octett, "%02X", (unsigned char)tmp[character]);
-        strcat(pdu, octett);
+        if (*hex == ' ')
+        {
+            hex++;
+            continue;
+        }
+        int value = octet2bin_check(hex);
+        if (value < 0 || length >= size)
+            return -1;
+        binary[length++] = value;
+        hex += 2;
     }
-    return counted_characters + udh_size_septets;
+    return length;
 }
 
-/* Converts binary to PDU string, this is basically a hex dump. */
-void binary2pdu(char* binary, int length, char* pdu)
+// Pack septets after an udh of udh_length octets, which is already written,
+// following filler bits up to the next septet boundary. Septets might be
+// zero, '@' is a valid character of the GSM alphabet. Returns the end of
+// the written hex dump.
+static char* text2pdu(char* pdu, const unsigned char* septets, int length, int udh_length)
 {
-    int character;
-    char octett[10];
+    int udh_septets = (udh_length * 8 + 6) / 7;
+    unsigned char octets[maxsms_binary + 8];
+    int count = gsm_pack(octets, septets, length, udh_septets * 7 - udh_length * 8);
+    return bin2hex(pdu, octets, count);
+}
 
-    if (length > maxsms_binary)
-        length = maxsms_binary;
-    pdu[0] = 0;
-    for (character = 0; character < length; character++)
-    {
-        sprintf(octett, "%02X", (unsigned char)binary[character]);
-        strcat(pdu, octett);
-    }
+// Converts binary to PDU string, this is basically a hex dump.
+static inline char* binary2pdu(char* pdu, const unsigned char* binary, int length)
+{
+    return bin2hex(pdu, binary, length);
+}
+
+// Copy at most size - 1 characters of a string field and terminate it
+static int copy_field(char* dest, int size, const char* src, int length = -1)
+{
+    if (length < 0)
+        length = strlen(src);
+    if (length > size - 1)
+        length = size - 1;
+    memcpy(dest, src, length);
+    dest[length] = '\0';
+    return length;
 }
 
 // Constructors/destructor
 PDU::PDU() :
-    m_pdu(NULL), m_pdu_ptr(NULL), m_message(NULL), m_message_len(-1), 
-    m_smsc(NULL), m_number(NULL), m_number_type(NULL), m_number_fmt(NF_UNKNOWN), 
-    m_date(NULL), m_time(NULL), m_udh_type(NULL), m_udh_data(NULL), m_err(NULL),
+    m_pdu_len(0), m_pdu_ptr(m_pdu), m_message_len(0),
+    m_number_fmt(NF_UNKNOWN),
     m_with_udh(false), m_report(false), m_is_statusreport(false), m_replace(0),
-    m_alphabet(-1), m_flash(false), m_mode(NULL), m_validity(170), 
+    m_alphabet(-1), m_flash(false), m_mode("new"), m_validity(170),
     m_system_msg(0), m_replace_msg(0)
 {
-    m_mode = "new";
-    m_pdu = (char*)malloc(max_pdu);
+    m_pdu[0] = '\0';
+    m_err[0] = '\0';
+    reset();
 }
 
-PDU::PDU(const char *pdu) :
-    m_pdu(NULL), m_pdu_ptr(NULL), m_message(NULL), m_message_len(-1), 
-    m_smsc(NULL), m_number(NULL), m_number_type(NULL), m_number_fmt(NF_UNKNOWN), 
-    m_date(NULL), m_time(NULL), m_udh_type(NULL), m_udh_data(NULL), m_err(NULL),
+PDU::PDU(const char *pdu, int pdu_len) :
+    m_pdu_len(0), m_pdu_ptr(m_pdu), m_message_len(0),
+    m_number_fmt(NF_UNKNOWN),
     m_with_udh(false), m_report(false), m_is_statusreport(false), m_replace(0),
-    m_alphabet(-1), m_flash(false), m_mode(NULL), m_validity(170), 
+    m_alphabet(-1), m_flash(false), m_mode("new"), m_validity(170),
     m_system_msg(0), m_replace_msg(0)
 {
-    if (pdu)
-    {
-        m_pdu = strdup(pdu);
-        m_pdu_ptr = m_pdu;
-        m_err = (char*)malloc(max_err);
-        m_err[0] = '\0';
-    }
+    m_err[0] = '\0';
+    reset();
+    setPDU(pdu, pdu_len);
 }
 
 PDU::~PDU()
 {
-    if (m_pdu)
-        free(m_pdu);
-
-    if (m_number)
-        free(m_number);
-
-    if (m_number_type)
-        free(m_number_type);
-
-    if (m_smsc)
-        free(m_smsc);
-
-    if (m_message)
-        free(m_message);
-    m_message = 0;
-
-    if (m_date)
-        free(m_date);
-
-    if (m_time)
-        free(m_time);
-
-    if (m_udh_type)
-        free(m_udh_type);
-
-    if (m_udh_data)
-        free(m_udh_data);
-
-    if (m_err)
-        free(m_err);
 }
 
 // Utility methods
 void PDU::reset()
 {
-    if (m_number)
-        free(m_number);
-    m_number = (char*)malloc(max_number);
     m_number[0] = '\0';
-    
-    if (m_number_type)
-        free(m_number_type);
-    m_number_type = (char*)malloc(max_number_type);
     m_number_type[0] = '\0';
-    
-    if (m_smsc)
-        free(m_smsc);
-    m_smsc = (char*)malloc(max_smsc);
     m_smsc[0] = '\0';
-    
-    if (m_message)
-        free(m_message);
-    m_message = (char*)malloc(max_message);
     m_message[0] = '\0';
     m_message_len = 0;
-    
-    if (m_date)
-        free(m_date);
-    m_date = (char*)malloc(max_date);
     m_date[0] = '\0';
-    
-    if (m_time)
-        free(m_time);
-    m_time = (char*)malloc(max_time);
     m_time[0] = '\0';
-    
-    if (m_udh_type)
-        free(m_udh_type);
-    m_udh_type = (char*)malloc(max_udh_type);
     m_udh_type[0] = '\0';
-    
-    if (m_udh_data)
-        free(m_udh_data);
-    m_udh_data = (char*)malloc(max_udh_data);
     m_udh_data[0] = '\0';
-    
-    if (!m_err)
-        m_err = (char*)malloc(max_err);
     m_err[0] = '\0';
-    
+
     m_with_udh = false;
     m_report = false;
     m_is_statusreport = false;
@@ -703,54 +1095,47 @@ void PDU::reset()
 
 int PDU::convert(const char *tocode, const char *fromcode)
 {
-    iconv_t cd = iconv_open(tocode, fromcode);
-    if (cd == (iconv_t)(-1) || !m_message)
+    iconv_t cd = iconv_cached(tocode, fromcode);
+    if (cd == (iconv_t)(-1))
         return -1;
-        
-    size_t inbytesleft = m_message_len;
-    size_t outbytesleft = max_message;
-    
-    char *tmp = (char*)malloc(outbytesleft);
+
+    char tmp[max_message];
     char *msg = m_message;
     char *out = tmp;
-    memset(tmp, 0, outbytesleft);
-    
+    size_t inbytesleft = m_message_len;
+    size_t outbytesleft = max_message - 1;
+
     iconv(cd, &msg, &inbytesleft, &out, &outbytesleft);
-    
-    if (m_message)
-        free(m_message);
-    m_message = tmp;
 
-    fprintf(stderr, "cc %s\n",m_message);
+    m_message_len = max_message - 1 - outbytesleft;
+    memcpy(m_message, tmp, m_message_len);
+    m_message[m_message_len] = '\0';
 
-    
-    iconv_close(cd);
-    
-    m_message_len = max_message - outbytesleft;
-    
     return m_message_len;
 }
 
 // Parsing
 bool PDU::parse()
 {   
-    if (!m_pdu)
+    reset();
+    m_pdu_ptr = m_pdu;
+
+    if (m_pdu_len < 0)
     {
-        sprintf(m_err, "PDU is NULL");
+        sprintf(m_err, "PDU is too long");
         return false;
     }
-    
+
     // Patch for Wavecom SR memory reading:
-    if (strncmp(m_pdu, "000000FF00", 10) == 0)
+    if (m_pdu_len >= 10 && strncmp(m_pdu, "000000FF00", 10) == 0)
     {
-        m_pdu[8] = '\0';
-        while (strlen(m_pdu) < 52)
-            strcat(m_pdu, "00");
+        memset(m_pdu + 8, '0', 52 - 8);
+        m_pdu_len = 52;
+        m_pdu[m_pdu_len] = '\0';
     }
     // ------------------------------------
-    reset();
-    
-    if (strlen(m_pdu) < 2)
+
+    if (m_pdu_len < 2)
     {
         sprintf(m_err, "PDU is too short");
         return false;
@@ -759,7 +1144,7 @@ bool PDU::parse()
     if (!parseSMSC())
         return false;
     
-    if (strlen(m_pdu_ptr) < 2)
+    if (left() < 2)
     {
         sprintf(m_err, "Reading First octet of the SMS-DELIVER PDU: PDU is too short");
         return false;
@@ -828,7 +1213,7 @@ bool PDU::parseSMSC()
         return true;
     }
 
-    if (length < 2 || length > max_smsc)
+    if (length < 2 || length > max_smsc / 2)
     {
         sprintf(m_err, "Invalid sender SMSC address length");
         return false;
@@ -836,7 +1221,7 @@ bool PDU::parseSMSC()
     
     length = length * 2 - 2;
     // No padding because the given value is number of octets.
-    if (strlen(m_pdu) < (size_t)(length + 4))
+    if (m_pdu_len < length + 4)
     {
         sprintf(m_err, "Reading SMSC address: PDU is too short");
         return false;
@@ -938,7 +1323,7 @@ int PDU::explainAddressType(const char *octet_char, int octet_int)
 
 bool PDU::parseDeliver()
 {
-    if (strlen(m_pdu_ptr) < 4)
+    if (left() < 4)
     {
         sprintf(m_err, "Reading address length and address type: PDU is too short");
         return false;
@@ -972,7 +1357,7 @@ bool PDU::parseDeliver()
         m_pdu_ptr += 2;
         if ((addr_type & 112) == 80) // Sender is alphanumeric
         {
-            if (strlen(m_pdu_ptr) < (size_t)(length + padding))
+            if (left() < length + padding)
             {
                 sprintf(m_err, "Reading sender address (alphanumeric): PDU is too short");
                 return false;
@@ -980,12 +1365,14 @@ bool PDU::parseDeliver()
             char tmpsender[100];
             char sender[100];
             snprintf(tmpsender, length + padding + 3, "%02X%s", length * 4 / 7, m_pdu_ptr);
-            if (pdu2text0(tmpsender, sender) < 0)
+            int senderlength = pdu2text0(tmpsender, sender);
+            if (senderlength < 0)
             {
                 sprintf(m_err, "Reading alphanumeric sender address: Invalid character(s)");
                 return false;
             }
-            strcpy(m_number, sender);
+            if (gsm_to_utf8(m_number, max_number, (unsigned char*)sender, senderlength) < 0)
+                m_number[0] = '\0';
         }
         else // Sender is numeric
         {
@@ -1028,7 +1415,7 @@ bool PDU::parseDeliver()
     // XXXXXXXXXXXXXX time stamp, 7 octets
     // XX length of user data
     // ( XX... user data  )
-    if (strlen(m_pdu_ptr) < 20)
+    if (left() < 20)
     {
         sprintf(m_err, "Reading TP-PID, TP-DSC, TP-SCTS and TP-UDL: PDU is too short");
         return false;
@@ -1080,7 +1467,7 @@ bool PDU::parseDeliver()
     {
         sprintf(m_err, "Invalid values(s) in date of Service Centre Time Stamp.\n");
     }
-    sprintf(m_date, str_buf);
+    copy_field(m_date, max_date, str_buf);
     
     // Time
     m_pdu_ptr += 6;
@@ -1096,7 +1483,7 @@ bool PDU::parseDeliver()
     {
         sprintf(m_err, "Invalid values(s) in time of Service Centre Time Stamp.\n");
     }
-    sprintf(m_time, "%s", str_buf);
+    copy_field(m_time, max_time, str_buf);
     
     m_pdu_ptr += 6;
     // Time zone is not used but bytes are checked:
@@ -1145,9 +1532,22 @@ bool PDU::parseDeliver()
         }
     }
     
-    memcpy(m_message, message, result);
-    m_message_len = result;
-    m_message[m_message_len] = '\0';
+    if (m_alphabet <= 0)
+    {
+        // Septets of the GSM alphabet, hand them over as UTF-8
+        if ((m_message_len = gsm_to_utf8(m_message, max_message, (unsigned char*)message, result)) < 0)
+        {
+            sprintf(m_err, "Error while reading TP-UD: GSM text too long");
+            m_message_len = 0;
+            return false;
+        }
+    }
+    else
+    {
+        memcpy(m_message, message, result);
+        m_message_len = result;
+        m_message[m_message_len] = '\0';
+    }
     strcpy(m_udh_type, udh_type);
     strcpy(m_udh_data, udh_data);
     
@@ -1157,7 +1557,7 @@ bool PDU::parseDeliver()
 bool PDU::parseStatusReport()
 {
     // There should be at least message-id, address-length and address-type:
-    if (strlen(m_pdu_ptr) < 6)
+    if (left() < 6)
     {
         sprintf(m_err, "Reading message id, address length and address type: PDU is too short");
         return false;
@@ -1196,7 +1596,7 @@ bool PDU::parseStatusReport()
     m_pdu_ptr += 2;
     if ((addr_type & 112) == 80) // Sender is alphanumeric
     {
-	if (strlen(m_pdu_ptr) < (size_t)(length + padding))
+	if (left() < length + padding)
 	{
 	    sprintf(m_err, "Reading sender address (alphanumeric): PDU is too short");
 	    return false;
@@ -1204,12 +1604,14 @@ bool PDU::parseStatusReport()
 	char tmpsender[100];
 	char sender[100];
 	snprintf(tmpsender, length + padding + 3, "%02X%s", length * 4 / 7, m_pdu_ptr);
-	if (pdu2text0(tmpsender, sender) < 0)
+	int senderlength = pdu2text0(tmpsender, sender);
+	if (senderlength < 0)
 	{
 	    sprintf(m_err, "Reading alphanumeric sender address: Invalid character(s)");
 	    return false;
 	}
-	    strcpy(m_number, sender);
+	if (gsm_to_utf8(m_number, max_number, (unsigned char*)sender, senderlength) < 0)
+	    m_number[0] = '\0';
     }
     else // Sender is numeric
     {
@@ -1245,7 +1647,7 @@ bool PDU::parseStatusReport()
     }
 
     m_pdu_ptr += length + padding;
-    if (strlen(m_pdu_ptr) < 14)
+    if (left() < 14)
     {
 	sprintf(m_err, "While trying to read SMSC Timestamp: PDU is too short");
 	return false;
@@ -1264,7 +1666,7 @@ bool PDU::parseStatusReport()
     {
 	sprintf(m_err, "Invalid value(s) in date of SMSC Timestamp.");
     }
-    sprintf(m_date, "%s", str_buf);
+    copy_field(m_date, max_date, str_buf);
 
     m_pdu_ptr += 6;
     sprintf(str_buf, "%c%c:%c%c:%c%c", m_pdu_ptr[1], m_pdu_ptr[0], m_pdu_ptr[3],
@@ -1279,7 +1681,7 @@ bool PDU::parseStatusReport()
     {
 	sprintf(m_err, "Invalid value(s) in time of SMSC Timestamp.");
     }
-    sprintf(m_time, "%s", str_buf);
+    copy_field(m_time, max_time, str_buf);
 
     m_pdu_ptr += 6;
     // Time zone is not used but bytes are checked:
@@ -1290,7 +1692,7 @@ bool PDU::parseStatusReport()
     }
     m_pdu_ptr += 2;
 
-    if (strlen(m_pdu_ptr) < 14)
+    if (left() < 14)
     {
 	sprintf(m_err, "While trying to read Discharge Timestamp: PDU is too short");
 	return false;
@@ -1329,7 +1731,7 @@ bool PDU::parseStatusReport()
     char discharge_timestamp[128];
     sprintf(discharge_timestamp, "%s", str_buf);
 
-    if (strlen(m_pdu_ptr) < 2)
+    if (left() < 2)
     {
 	sprintf(m_err, "While trying to read Status octet: PDU is too short");
 	return false;
@@ -1353,59 +1755,45 @@ bool PDU::parseStatusReport()
 // PDU Generation
 void PDU::generate()
 {
-    int coding;
-    int flags;
-    char tmp[max_message];
-    char tmp2[500];
-    int numberformat;
-    int numberlength;
-    char *p;
-    int l;
-    char tmp_smsc[max_smsc];
-
     if (m_alphabet == 2)
-	convert("UTF16BE", "UTF8");
-
+        convert("UTF16BE", "UTF8");
 
-    if (m_number[0] == 's')  // Is number starts with s, then send it without number format indicator
-    {
-        numberformat = NF_UNKNOWN;
-        snprintf(tmp, sizeof(tmp), "%s", m_number +1);
-    }
-    else
+    // 7 bit text: UTF-8 to the GSM alphabet, what it lacks turns into '?'
+    unsigned char septets[max_message * 2];
+    if (m_alphabet != 1 && m_alphabet != 2)
     {
-        numberformat = NF_INTERNATIONAL;
-        snprintf(tmp, sizeof(tmp), "%s", m_number);
+        m_message_len = utf8_to_gsm(septets, sizeof(septets), m_message, m_message_len, 0x3F);
+        if (m_message_len < 0)
+            m_message_len = 0;
     }
 
-    numberlength = strlen(tmp);
-    // terminate the number with F if the length is odd
-    if (numberlength % 2)
-        strcat(tmp, "F");
-    // Swap every second character
-    swapchars(tmp);
-
-    // 3.1.12:
-    *tmp_smsc = 0;
-    if (m_smsc && m_smsc[0])
+    // Is number starts with s, then send it without number format indicator
+    const char* number = m_number;
+    int numberformat = NF_INTERNATIONAL;
+    if (*number == 's')
     {
-        p = m_smsc;
-        while (*p == '+')
-            p++;
-        snprintf(tmp_smsc, sizeof(tmp_smsc), "%s", p);
-        if (strlen(tmp_smsc) % 2 && strlen(tmp_smsc) < sizeof(tmp_smsc) - 1)
-            strcat(tmp_smsc, "F");
-        swapchars(tmp_smsc);
+        numberformat = NF_UNKNOWN;
+        number++;
     }
+    else if (*number == '+')
+        number++;
+    int numberlength = strlen(number);
+
+    unsigned char udh[maxsms_binary];
+    int udh_length = 0;
+    if (m_with_udh && (udh_length = hexdump2bin(m_udh_data, udh, sizeof(udh))) < 0)
+        udh_length = 0;
 
-    flags = 1; // SMS-Sumbit MS to SMSC
-    if (m_with_udh)
+    int flags = 1; // SMS-Sumbit MS to SMSC
+    if (udh_length)
         flags += 64; // User Data Header
-    if (strcmp(m_mode, "old") != 0)
+    bool old = (strcmp(m_mode, "old") == 0);
+    if (!old)
         flags += 16; // Validity field
     if (m_report)
         flags += 32; // Request Status Report
 
+    int coding;
     if (m_alphabet == 1)
         coding = 4; // 8bit binary
     else if (m_alphabet == 2)
@@ -1415,36 +1803,34 @@ void PDU::generate()
     if (m_flash)
         coding += 0x10; // Bits 1 and 0 have a message class meaning (class 0, alert)
 
-    /* Create the PDU string of the message */
+    // User data length counts the udh, in octets or in septets for 7 bit text
+    int length = m_message_len;
+    int udl;
     if (m_alphabet == 1 || m_alphabet == 2)
     {
-        // Unicode message can be concatenated:
-        //if (alphabet == 2 && with_udh)
-        // Binary message can be concatenated too:
-        if (m_with_udh)
+        // Unicode and binary messages can be concatenated
+        if (length > maxsms_binary - udh_length)
+            length = maxsms_binary - udh_length;
+        udl = udh_length + length;
+    }
+    else
+    {
+        int udh_septets = (udh_length * 8 + 6) / 7;
+        if (length > max_pdu - udh_septets)
         {
-            strcpy(tmp2, m_udh_data);
-            while ((p = strchr(tmp2, ' ')))
-                strcpyo(p, p + 1);
-            l = strlen(tmp2) / 2;
-            binary2pdu(m_message, m_message_len, strchr(tmp2, 0));
-            m_message_len += l;
+            length = max_pdu - udh_septets;
+            // Do not cut between an escape and its extension septet
+            if (length > 0 && septets[length - 1] == 0x1B)
+                length--;
         }
-        else
-            binary2pdu(m_message, m_message_len, tmp2);
+        udl = udh_septets + length;
     }
-    else
-        m_message_len = text2pdu(m_message, m_message_len, tmp2, m_udh_data);
 
+    char* p = m_pdu;
     int smsc_len = 0;
-    /* concatenate the first part of the PDU string */
-    if (strcmp(m_mode, "old") == 0)
-        sprintf(m_pdu, "%02X00%02X%02X%s00%02X%02X", flags, numberlength, 
-                numberformat, tmp, coding, m_message_len);
-    else
+    int proto = 0;
+    if (!old)
     {
-        int proto = 0;
-
         if (m_validity < 0 || m_validity > 255)
             m_validity = validity_period;
 
@@ -1463,56 +1849,79 @@ void PDU::generate()
         else if (m_replace_msg >= 1 && m_replace_msg <= 7)
             proto = 0x40 + m_replace_msg;
 
-        if (*tmp_smsc)
-            sprintf(m_pdu, "%02X%s%s", (int)strlen(tmp_smsc) / 2 + 1, 
-                    (tmp_smsc[1] == '0') ? "81": "91", tmp_smsc);
+        // 3.1.12:
+        const char* smsc = m_smsc;
+        while (*smsc == '+')
+            smsc++;
+        int smsclength = strlen(smsc);
+        if (smsclength)
+        {
+            p = bin2octet(p, (smsclength + 1) / 2 + 1);
+            p = bin2octet(p, (smsc[0] == '0') ? 0x81 : 0x91);
+            p = digits2octets(p, smsc, smsclength);
+        }
         else
-            strcpy(m_pdu, "00");
-        
-        smsc_len = strlen(m_pdu);
-        
-        sprintf(strchr(m_pdu, 0), "%02X00%02X%02X%s%02X%02X%02X%02X", flags, 
-                numberlength, numberformat, tmp, proto, coding, m_validity, 
-                m_message_len);
-        
-    }
-    /* concatenate the text to the PDU string */
-    strcat(m_pdu,tmp2);
-    m_message_len = (strlen(m_pdu) - smsc_len)/2;
+            p = bin2octet(p, 0);
+        smsc_len = p - m_pdu;
+    }
+
+    /* the header of the PDU string */
+    p = bin2octet(p, flags);
+    p = bin2octet(p, 0);
+    p = bin2octet(p, numberlength);
+    p = bin2octet(p, numberformat);
+    p = digits2octets(p, number, numberlength);
+    p = bin2octet(p, proto);
+    p = bin2octet(p, coding);
+    if (!old)
+        p = bin2octet(p, m_validity);
+    p = bin2octet(p, udl);
+
+    /* the user data */
+    p = binary2pdu(p, udh, udh_length);
+    if (m_alphabet == 1 || m_alphabet == 2)
+        p = binary2pdu(p, (const unsigned char*)m_message, length);
+    else
+        p = text2pdu(p, septets, length, udh_length);
+    *p = '\0';
+
+    m_pdu_len = p - m_pdu;
+    m_message_len = (m_pdu_len - smsc_len) / 2;
 }
 
 // Setters
+void PDU::setPDU(const char* pdu, int pdu_len)
+{
+    if (!pdu)
+        pdu_len = 0;
+    else if (pdu_len < 0)
+        pdu_len = strlen(pdu);
+    m_pdu_ptr = m_pdu;
+    if (pdu_len >= max_pdu_hex)
+    {
+        m_pdu[0] = '\0';
+        m_pdu_len = -1;
+        return;
+    }
+    m_pdu_len = copy_field(m_pdu, max_pdu_hex, pdu ? pdu : "", pdu_len);
+}
+
 void PDU::setMessage(const char* message, const int message_len)
 {
     if (message)
-    {
-        m_message_len = (message_len < 0) ? strlen(message) : message_len;
-        if (m_message)
-            free(m_message);
-        m_message = (char*)malloc(m_message_len + 1);
-        memcpy(m_message, message, m_message_len);
-        m_message[m_message_len] = '\0';
-    }
+        m_message_len = copy_field(m_message, max_message, message, message_len);
 }
 
 void PDU::setSMSC(const char* smsc)
 {
     if (smsc)
-    {
-        if (m_smsc)
-            free(m_smsc);
-        m_smsc = strdup(smsc);
-    }
+        copy_field(m_smsc, max_smsc, smsc);
 }
 
 void PDU::setNumber(const char* number)
 {
     if (number)
-    {
-        if (m_number)
-            free(m_number);
-        m_number = strdup(number);
-    }
+        copy_field(m_number, max_number, number);
 }
 
 void PDU::setAlphabet(const Alphabet alphabet)
@@ -1520,5 +1929,135 @@ void PDU::setAlphabet(const Alphabet alphabet)
     m_alphabet = (int)alphabet;
 }
 
+// UDH in hex-dump format with spaces, first octet is the UDH length: "05 00 03 AF 02 01"
+void PDU::setUDH(const char* udh)
+{
+    m_with_udh = (udh && *udh);
+    copy_field(m_udh_data, max_udh_data, m_with_udh ? udh : "");
+}
+
+bool PDU::getConcat(int& ref, int& parts, int& part) const
+{
+    if (!m_with_udh)
+        return false;
+    unsigned char udh[maxsms_binary];
+    int length = hexdump2bin(m_udh_data, udh, sizeof(udh));
+    if (length < 1 || udh[0] >= length)
+        return false;
+    // Information elements: identifier, length, data
+    for (int i = 1; i + 1 < udh[0] + 1; i += 2 + udh[i + 1])
+    {
+        const unsigned char* ie = udh + i + 2;
+        if (i + 2 + udh[i + 1] > udh[0] + 1)
+            break;
+        if (udh[i] == 0x00 && udh[i + 1] == 3)
+            ref = ie[0];
+        else if (udh[i] == 0x08 && udh[i + 1] == 4)
+        {
+            ref = (ie[0] << 8) | ie[1];
+            ie++;
+        }
+        else
+            continue;
+        parts = ie[1];
+        part = ie[2];
+        return parts > 0 && part > 0 && part <= parts;
+    }
+    return false;
+}
+
+void PDU::setConcat(int ref, int parts, int part, bool ref16)
+{
+    char udh[32];
+    if (ref16)
+        snprintf(udh, sizeof(udh), "06 08 04 %02X %02X %02X %02X",
+                 (ref >> 8) & 0xff, ref & 0xff, parts & 0xff, part & 0xff);
+    else
+        snprintf(udh, sizeof(udh), "05 00 03 %02X %02X %02X",
+                 ref & 0xff, parts & 0xff, part & 0xff);
+    setUDH(udh);
+}
+
+// Concatenation
+
+// Room a character takes in a message of the alphabet: septets, UTF-16
+// units or octets. Advances *text past it
+static inline int char_cost(const unsigned char** text, const unsigned char* end,
+                            PDU::Alphabet alphabet)
+{
+    if (alphabet == PDU::BINARY)
+    {
+        (*text)++;
+        return 1;
+    }
+    if (alphabet == PDU::UCS2)
+        return (utf8char(text, end) >= 0x10000) ? 2 : 1;
+    // Characters missing from the GSM alphabet go as '?'
+    int gsm = utf8char2gsm(text, end);
+    if (gsm < 0)
+        return 1;
+    return (gsm & 0x100) ? 2 : 1;
+}
+
+int PDU::split(const char* message, int message_len, Alphabet alphabet, bool ref16,
+               int* parts, int max_parts)
+{
+    if (message_len < 0)
+        message_len = strlen(message);
+    if (max_parts <= 0)
+        return 0;
+    const unsigned char* text = (const unsigned char*)message;
+    const unsigned char* end = text + message_len;
+
+    // Room of a single SMS and of a part after the concatenation UDH
+    int udh_length = ref16 ? 7 : 6;
+    int single;
+    int room;
+    if (alphabet == UCS2)
+    {
+        single = maxsms_binary / 2;
+        room = (maxsms_binary - udh_length) / 2;
+    }
+    else if (alphabet == BINARY)
+    {
+        single = maxsms_binary;
+        room = maxsms_binary - udh_length;
+    }
+    else
+    {
+        single = max_pdu;
+        room = max_pdu - (udh_length * 8 + 6) / 7;
+    }
+
+    int total = 0;
+    for (const unsigned char* p = text; p < end && total <= single; )
+        total += char_cost(&p, end, alphabet);
+    if (total <= single)
+    {
+        parts[0] = message_len;
+        return 1;
+    }
+
+    int count = 0;
+    int used = 0;
+    const unsigned char* start = text;
+    for (const unsigned char* p = text; p < end; )
+    {
+        const unsigned char* c = p;
+        int cost = char_cost(&p, end, alphabet);
+        if (used + cost > room)
+        {
+            if (count + 1 >= max_parts)
+                return 0;
+            parts[count++] = c - start;
+            start = c;
+            used = 0;
+        }
+        used += cost;
+    }
+    parts[count++] = end - start;
+    return count;
+}
+
 /* vi: set ts=8 sw=4 sts=4 noet: */
 
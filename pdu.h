@@ -12,7 +12,80 @@ Either version 2 of the License, or (at your option) any later version.
 #ifndef PDU_H
 #define PDU_H
 
+#include <iconv.h>
 
+// Sizes of the PDU fields, all include the terminating NUL
+const int max_number = 64;
+const int max_number_type = 1024;
+const int max_smsc = 64;
+const int max_date = 32;
+const int max_time = 32;
+const int max_udh_data = 512;
+const int max_udh_type = 512;
+const int max_err = 1024;
+const int maxsms_binary = 140;
+const int max_message = maxsms_binary * 4;
+// hex dump of a whole SMS-SUBMIT: SMSC, header, address and user data octets
+const int max_pdu_hex = 2 * (max_smsc / 2 + 6 + max_number / 2 + 4 + maxsms_binary) + 1;
+
+/**
+ * Get the calling thread's conversion descriptor for a charset pair, opened
+ * on first use and reset to the initial shift state. The descriptor stays
+ * owned by the cache and is closed when the thread exits, so never pass it
+ * to iconv_close().
+ * Returns (iconv_t)-1 if the pair cannot be opened or the cache is full.
+ */
+iconv_t iconv_cached(const char* tocode, const char* fromcode);
+
+/**
+ * Decode a hex dump of upper or lower case digits, SSE2 accelerated.
+ * length is the number of digits, an odd last one is ignored.
+ * Returns the number of octets written to binary or -1 on an invalid digit.
+ */
+int hex2bin(unsigned char* binary, const char* hex, int length);
+
+/**
+ * Encode length octets as upper case hex digits, SSE2 accelerated.
+ * Returns the position after the written digits, no NUL is appended.
+ */
+char* bin2hex(char* hex, const unsigned char* binary, int length);
+
+/**
+ * Count the septets of UTF-8 text in the GSM 03.38 default alphabet,
+ * extension table characters take two.
+ * Returns -1 if some character has no GSM representation.
+ */
+int utf8_gsm_septets(const char* utf8, int length = -1);
+
+/**
+ * Map UTF-8 text to GSM 03.38 septets, one per byte, extension table
+ * characters are preceded by the 0x1B escape.
+ * replace is the septet for characters missing from the alphabet, -1 to fail.
+ * Returns the number of septets or -1 if they do not fit in size.
+ */
+int utf8_to_gsm(unsigned char* septets, int size, const char* utf8, int length, int replace = -1);
+
+/**
+ * Map GSM 03.38 septets back to NUL terminated UTF-8.
+ * Returns the number of bytes or -1 if they do not fit in size.
+ */
+int gsm_to_utf8(char* utf8, int size, const unsigned char* septets, int length);
+
+/**
+ * Pack septets into octets eight at a time, after fill zero bits.
+ * Returns the number of octets written.
+ */
+int gsm_pack(unsigned char* octets, const unsigned char* septets, int length, int fill = 0);
+
+/**
+ * Unpack length septets starting at the first bit of octets.
+ */
+void gsm_unpack(unsigned char* septets, const unsigned char* octets, int length);
+
+/**
+ * SMS PDU codec. All fields live in fixed buffers inside the object, so it
+ * never allocates: keep one around and reuse it with setPDU() or the setters.
+ */
 class PDU {
 public:
     enum NumerFormat {
@@ -30,11 +103,12 @@ public:
 
     // Constructors/Destructor
     PDU();
-    PDU(const char *pdu);
+    PDU(const char *pdu, int pdu_len = -1);
     virtual ~PDU();
 
     // Getters
     inline const char* getPDU() const { return m_pdu; }
+    inline int getPDULen() const { return m_pdu_len; }
     inline const char* getSMSC() const { return m_smsc; }
     inline const char* getNumber() const { return m_number; }
     inline const char* getNumberType() const { return m_number_type; }
@@ -46,11 +120,39 @@ public:
     inline const char* getError() const { return m_err; }
     inline const int getMessageLen() const { return m_message_len; }
 
+    /**
+     * Get the concatenation element of the UDH, 8 or 16 bit reference
+     * @return true if the message is a part of a concatenated one
+     */
+    bool getConcat(int& ref, int& parts, int& part) const;
+
     // Setters
+    void setPDU(const char* pdu, int pdu_len = -1);
     void setMessage(const char* message, const int message_len = -1);
     void setSMSC(const char* smsc);
     void setNumber(const char* number);
     void setAlphabet(const Alphabet alphabet);
+    void setUDH(const char* udh);
+
+    /**
+     * Set the concatenation UDH of one part of a long message
+     * @param ref - reference shared by all parts
+     * @param parts - number of parts
+     * @param part - this part, from 1
+     * @param ref16 - use the 16 bit reference element instead of 8 bit
+     */
+    void setConcat(int ref, int parts, int part, bool ref16 = false);
+
+    /**
+     * Split UTF-8 text into the parts of a concatenated message, breaking
+     * only between characters
+     * @param parts - filled with the byte length of each part
+     * @param max_parts - size of parts
+     * @return number of parts, 1 if it fits a single SMS, 0 if it needs
+     *  more than max_parts
+     */
+    static int split(const char* message, int message_len, Alphabet alphabet, bool ref16,
+                     int* parts, int max_parts);
 
     //
     bool parse();
@@ -59,19 +161,20 @@ public:
     // iconv
     int convert(const char *tocode, const char *fromcode);
 private:
-    char* m_pdu;
+    char m_pdu[max_pdu_hex];
+    int m_pdu_len;	// -1 if the PDU given to parse did not fit
     char* m_pdu_ptr;
-    char* m_message;
+    char m_message[max_message];
     int m_message_len;
-    char* m_smsc; 
-    char* m_number;
-    char* m_number_type;
+    char m_smsc[max_smsc];
+    char m_number[max_number];
+    char m_number_type[max_number_type];
     NumerFormat m_number_fmt;
-    char* m_date;
-    char* m_time;
-    char* m_udh_type;
-    char* m_udh_data;
-    char* m_err;
+    char m_date[max_date];
+    char m_time[max_time];
+    char m_udh_type[max_udh_type];
+    char m_udh_data[max_udh_data];
+    char m_err[max_err];
     bool m_with_udh;
     bool m_report;
     bool m_is_statusreport;
@@ -84,6 +187,7 @@ private:
     int m_replace_msg;
 
     void reset();
+    inline int left() const { return m_pdu_len - (int)(m_pdu_ptr - m_pdu); }
     bool parseSMSC();
     bool parseDeliver();
     bool parseStatusReport();
@@ -0,0 +1,732 @@
+/**
+ * modemsim.cpp
+ * This file is part of the Yate-datacard Project http://code.google.com/p/yate-datacard/
+ * Yate datacard channel driver for Huawei UMTS modem
+ *
+ * Huawei modem simulator: every virtual modem gets a pair of pseudo ttys
+ * that stand for the data (AT) and audio ports of an E1550/E173 stick
+ *
+ * Copyright (C) 2010-2011 MBloody
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Same framing as the driver: 20 msec of 8 kHz 16 bit slin
+#define SIM_FRAME_MSEC	20
+#define SIM_FRAME_SIZE	320
+#define SIM_MODEMS_MAX	512
+#define SIM_LINE_MAX	1024
+// Do not try to catch up more than this many frames after a stall
+#define SIM_CATCHUP_MAX	5
+// Messages the ME storage holds
+#define SIM_SMS_STORAGE	50
+
+enum sim_call_t {
+    CALL_IDLE = 0,
+    CALL_DIALING,	// ATD accepted, waiting ^CONN
+    CALL_ALERTING,	// incoming RING/+CLIP, waiting ATA
+    CALL_ACTIVE,	// audio flowing
+};
+
+static volatile bool s_running = true;
+static volatile bool s_dump = false;
+
+// Simulation parameters, in msec unless noted
+static unsigned int s_answer = 3000;	// outgoing call answered after
+static unsigned int s_duration = 60000;	// active call cleared by network after
+static unsigned int s_incoming = 0;	// period of incoming calls, 0 to disable
+static unsigned int s_sms = 0;		// period of incoming SMS, 0 to disable
+static unsigned int s_rssi = 10000;	// period of ^RSSI reports
+static const char* s_model = "E1550";
+
+static u_int64_t msecNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Open the master side of a pty, leave the slave open so the master
+//  does not see a hangup while the driver reopens the port
+static int openPty(int& slave, char* name, size_t len)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0)
+	return -1;
+    if (grantpt(fd) || unlockpt(fd) || ptsname_r(fd, name, len))
+    {
+	close(fd);
+	return -1;
+    }
+    struct termios term;
+    if (!tcgetattr(fd, &term))
+    {
+	cfmakeraw(&term);
+	tcsetattr(fd, TCSANOW, &term);
+    }
+    slave = open(name, O_RDWR | O_NOCTTY);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Pack ASCII text to GSM 7 bit septets and write them as hex
+static int pack7bit(const char* text, char* hex)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    unsigned int acc = 0;
+    int bits = 0;
+    int len = 0;
+    for (; *text; text++)
+    {
+	acc |= (unsigned int)(*text & 0x7f) << bits;
+	bits += 7;
+	while (bits >= 8)
+	{
+	    hex[len++] = digits[(acc >> 4) & 0x0f];
+	    hex[len++] = digits[acc & 0x0f];
+	    acc >>= 8;
+	    bits -= 8;
+	}
+    }
+    if (bits)
+    {
+	hex[len++] = digits[(acc >> 4) & 0x0f];
+	hex[len++] = digits[acc & 0x0f];
+    }
+    hex[len] = '\0';
+    return len;
+}
+
+// Write a phone number as swapped semi-octets padded with F
+static int swapDigits(const char* num, char* out)
+{
+    int len = 0;
+    int n = strlen(num);
+    for (int i = 0; i < n; i += 2)
+    {
+	out[len++] = (i + 1 < n) ? num[i + 1] : 'F';
+	out[len++] = num[i];
+    }
+    out[len] = '\0';
+    return len;
+}
+
+class SimModem
+{
+public:
+    SimModem(unsigned int index);
+    ~SimModem();
+    bool open(const char* dir);
+    void readData();
+    void readAudio();
+    void timer(u_int64_t now);
+    void sendAudio(const short* tone, unsigned int frames);
+    void dump() const;
+
+    unsigned int m_index;
+    int m_data;
+    int m_audio;
+    int m_dataSlave;
+    int m_audioSlave;
+    sim_call_t m_call;
+    // counters
+    unsigned long m_commands;
+    unsigned long m_calls;
+    unsigned long m_smsIn;
+    unsigned long m_smsOut;
+    unsigned long m_framesOut;
+    unsigned long m_bytesIn;
+    unsigned long m_overruns;
+
+private:
+    void command(char* cmd);
+    void smsBody(char* pdu);
+    int smsDeliver(char* pdu, size_t size, unsigned int index);
+    void reply(const char* str);
+    void replyf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+    void endCall(int status, int cause);
+
+    char m_line[SIM_LINE_MAX];
+    unsigned int m_lineLen;
+    bool m_echo;
+    bool m_initialized;	// AT+CNMI seen, unsolicited events allowed
+    bool m_smsPrompt;	// collecting a PDU after AT+CMGS
+    int m_rssiLevel;
+    unsigned int m_smsRef;
+    unsigned int m_smsIndex;
+    unsigned int m_smsStored;	// messages in storage, the last ones indexed
+    u_int64_t m_callStart;
+    // event deadlines, 0 if not armed
+    u_int64_t m_connAt;
+    u_int64_t m_endAt;
+    u_int64_t m_ringAt;
+    u_int64_t m_missAt;
+    u_int64_t m_cusdAt;
+    u_int64_t m_rssiAt;
+    u_int64_t m_nextCall;
+    u_int64_t m_nextSms;
+    char m_dataName[256];
+    char m_audioName[256];
+};
+
+SimModem::SimModem(unsigned int index)
+    : m_index(index), m_data(-1), m_audio(-1), m_dataSlave(-1), m_audioSlave(-1),
+    m_call(CALL_IDLE),
+    m_commands(0), m_calls(0), m_smsIn(0), m_smsOut(0), m_framesOut(0), m_bytesIn(0), m_overruns(0),
+    m_lineLen(0), m_echo(true), m_initialized(false), m_smsPrompt(false),
+    m_rssiLevel(14 + index % 10), m_smsRef(0), m_smsIndex(0), m_smsStored(0), m_callStart(0),
+    m_connAt(0), m_endAt(0), m_ringAt(0), m_missAt(0), m_cusdAt(0), m_rssiAt(0),
+    m_nextCall(0), m_nextSms(0)
+{
+    m_dataName[0] = m_audioName[0] = '\0';
+}
+
+SimModem::~SimModem()
+{
+    int fds[4] = { m_data, m_audio, m_dataSlave, m_audioSlave };
+    for (int i = 0; i < 4; i++)
+	if (fds[i] >= 0)
+	    close(fds[i]);
+}
+
+bool SimModem::open(const char* dir)
+{
+    m_data = openPty(m_dataSlave, m_dataName, sizeof(m_dataName));
+    if (m_data < 0)
+	return false;
+    m_audio = openPty(m_audioSlave, m_audioName, sizeof(m_audioName));
+    if (m_audio < 0)
+	return false;
+    if (dir)
+    {
+	// Stable names for datacard.conf, the pts numbers change every run
+	char link[256];
+	snprintf(link, sizeof(link), "%s/data%u", dir, m_index);
+	unlink(link);
+	if (symlink(m_dataName, link))
+	    fprintf(stderr, "Cannot link %s: %s\n", link, strerror(errno));
+	else
+	    snprintf(m_dataName, sizeof(m_dataName), "%s", link);
+	snprintf(link, sizeof(link), "%s/audio%u", dir, m_index);
+	unlink(link);
+	if (symlink(m_audioName, link))
+	    fprintf(stderr, "Cannot link %s: %s\n", link, strerror(errno));
+	else
+	    snprintf(m_audioName, sizeof(m_audioName), "%s", link);
+    }
+    // Spread periodic events so the modems do not fire in lockstep
+    u_int64_t now = msecNow();
+    m_rssiAt = now + s_rssi + (m_index * 97) % s_rssi;
+    if (s_incoming)
+	m_nextCall = now + s_incoming + (m_index * 131) % s_incoming;
+    if (s_sms)
+	m_nextSms = now + s_sms + (m_index * 173) % s_sms;
+    printf("[sim%u]\ndata=%s\naudio=%s\n\n", m_index, m_dataName, m_audioName);
+    return true;
+}
+
+void SimModem::reply(const char* str)
+{
+    char buf[SIM_LINE_MAX + 4];
+    int len = snprintf(buf, sizeof(buf), "\r\n%s\r\n", str);
+    if (write(m_data, buf, len) != len)
+	m_overruns++;
+}
+
+void SimModem::replyf(const char* fmt, ...)
+{
+    char buf[SIM_LINE_MAX];
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, va);
+    va_end(va);
+    reply(buf);
+}
+
+void SimModem::endCall(int status, int cause)
+{
+    if (m_call == CALL_IDLE)
+	return;
+    unsigned int dur = m_callStart ? (unsigned int)((msecNow() - m_callStart) / 1000) : 0;
+    replyf("^CEND:1,%u,%d,%d", dur, status, cause);
+    m_call = CALL_IDLE;
+    m_callStart = 0;
+    m_connAt = m_endAt = m_ringAt = m_missAt = 0;
+}
+
+void SimModem::readData()
+{
+    char buf[SIM_LINE_MAX];
+    ssize_t len = read(m_data, buf, sizeof(buf));
+    if (len <= 0)
+	return;
+    if (m_echo && !m_smsPrompt)
+	write(m_data, buf, len);
+    for (ssize_t i = 0; i < len; i++)
+    {
+	char c = buf[i];
+	if (m_smsPrompt)
+	{
+	    // The PDU ends with Ctrl-Z, ESC aborts the prompt
+	    if (c == 0x1a || c == 0x1b)
+	    {
+		m_line[m_lineLen] = '\0';
+		m_lineLen = 0;
+		m_smsPrompt = false;
+		if (c == 0x1a)
+		    smsBody(m_line);
+		else
+		    reply("OK");
+	    }
+	    else if (m_lineLen < sizeof(m_line) - 1)
+		m_line[m_lineLen++] = c;
+	    continue;
+	}
+	if (c == '\r' || c == '\n')
+	{
+	    if (!m_lineLen)
+		continue;
+	    m_line[m_lineLen] = '\0';
+	    m_lineLen = 0;
+	    command(m_line);
+	}
+	else if (m_lineLen < sizeof(m_line) - 1)
+	    m_line[m_lineLen++] = c;
+    }
+}
+
+void SimModem::readAudio()
+{
+    char buf[SIM_FRAME_SIZE * 4];
+    ssize_t len;
+    while ((len = read(m_audio, buf, sizeof(buf))) > 0)
+	m_bytesIn += len;
+}
+
+void SimModem::command(char* cmd)
+{
+    m_commands++;
+    if (strncasecmp(cmd, "AT", 2))
+    {
+	reply("ERROR");
+	return;
+    }
+    const char* p = cmd + 2;
+
+    if (!*p || !strncmp(p, "+CMEE=", 6) || !strncmp(p, "+COPS=", 6)
+	|| !strncmp(p, "+CREG=", 6) || !strncmp(p, "+CLIP=", 6) || !strncmp(p, "+CSSN=", 6)
+	|| !strncmp(p, "+CMGF=", 6) || !strncmp(p, "+CLVL=", 6) || !strncmp(p, "^DDSETEX=", 9)
+	|| !strncmp(p, "+CLIR=", 6) || !strncmp(p, "+CCWA=", 6) || !strncmp(p, "+CFUN=", 6)
+	|| !strncmp(p, "^U2DIAG=", 8))
+	reply("OK");
+    else if (!strcmp(p, "Z"))
+    {
+	m_echo = true;
+	m_initialized = false;
+	endCall(0, 16);
+	reply("OK");
+    }
+    else if (!strcmp(p, "E0"))
+    {
+	m_echo = false;
+	reply("OK");
+    }
+    else if (!strcmp(p, "+CGMI"))
+	reply("huawei\r\n\r\nOK");
+    else if (!strcmp(p, "+CGMM"))
+	replyf("%s\r\n\r\nOK", s_model);
+    else if (!strcmp(p, "+CGMR"))
+	reply("11.608.14.02.311\r\n\r\nOK");
+    else if (!strcmp(p, "+CGSN"))
+	replyf("35483203%07u\r\n\r\nOK", m_index);
+    else if (!strcmp(p, "+CIMI"))
+	replyf("25099%010u\r\n\r\nOK", m_index);
+    else if (!strcmp(p, "+CPIN?"))
+	reply("+CPIN: READY\r\n\r\nOK");
+    else if (!strcmp(p, "+CREG?"))
+	replyf("+CREG: 2,1,\"1B95\",\"%04X\"\r\n\r\nOK", 0x0D00 + m_index);
+    else if (!strcmp(p, "+COPS?"))
+	reply("+COPS: 0,0,\"MODEMSIM\",2\r\n\r\nOK");
+    else if (!strcmp(p, "+CNUM"))
+	replyf("+CNUM: \"\",\"+7900%07u\",145\r\n\r\nOK", m_index);
+    else if (!strcmp(p, "^CVOICE?"))
+	reply("^CVOICE:0,8000,16,20\r\n\r\nOK");
+    else if (!strcmp(p, "+CSQ"))
+	replyf("+CSQ: %d,99\r\n\r\nOK", m_rssiLevel);
+    else if (!strncmp(p, "+CPMS=", 6))
+	replyf("+CPMS: %u,%u,%u,%u,%u,%u\r\n\r\nOK", m_smsStored, SIM_SMS_STORAGE,
+	    m_smsStored, SIM_SMS_STORAGE, m_smsStored, SIM_SMS_STORAGE);
+    else if (!strncmp(p, "+CNMI=", 6))
+    {
+	m_initialized = true;
+	reply("OK");
+    }
+    else if (*p == 'D')
+    {
+	if (m_call != CALL_IDLE)
+	{
+	    reply("ERROR");
+	    return;
+	}
+	m_calls++;
+	m_call = CALL_DIALING;
+	reply("OK");
+	reply("^ORIG:1,0");
+	m_connAt = msecNow() + s_answer;
+    }
+    else if (!strcmp(p, "A"))
+    {
+	if (m_call != CALL_ALERTING)
+	{
+	    reply("NO CARRIER");
+	    return;
+	}
+	reply("OK");
+	reply("^CONN:1,0");
+	m_call = CALL_ACTIVE;
+	m_callStart = msecNow();
+	m_ringAt = m_missAt = 0;
+	m_endAt = m_callStart + s_duration;
+    }
+    else if (!strcmp(p, "+CHUP"))
+    {
+	reply("OK");
+	endCall(104, 16);
+    }
+    else if (!strncmp(p, "^DTMF=", 6))
+	reply(m_call == CALL_ACTIVE ? "OK" : "ERROR");
+    else if (!strncmp(p, "+CUSD=1,", 8))
+    {
+	reply("OK");
+	m_cusdAt = msecNow() + 500;
+    }
+    else if (!strncmp(p, "+CMGS=", 6))
+    {
+	m_smsPrompt = true;
+	m_lineLen = 0;
+	if (write(m_data, "\r\n> ", 4) != 4)
+	    m_overruns++;
+    }
+    else if (!strncmp(p, "+CMGR=", 6))
+    {
+	char pdu[320];
+	int len = smsDeliver(pdu, sizeof(pdu), atoi(p + 6));
+	replyf("+CMGR: 0,,%d\r\n%s\r\n\r\nOK", len / 2 - 1, pdu);
+    }
+    else if (!strncmp(p, "+CMGL=", 6))
+    {
+	// The stored messages are the last ones indexed, all listed as read
+	char pdu[320];
+	for (unsigned int i = 0; i < m_smsStored; i++)
+	{
+	    unsigned int index = (m_smsIndex + SIM_SMS_STORAGE - m_smsStored + i) % SIM_SMS_STORAGE;
+	    int len = smsDeliver(pdu, sizeof(pdu), index);
+	    replyf("+CMGL: %u,1,,%d\r\n%s", index, len / 2 - 1, pdu);
+	}
+	reply("OK");
+    }
+    else if (!strncmp(p, "+CMGD=", 6))
+    {
+	// A delete flag clears the storage, a single index takes one message
+	if (strchr(p, ','))
+	    m_smsStored = 0;
+	else if (m_smsStored)
+	    m_smsStored--;
+	reply("OK");
+    }
+    else
+	reply("COMMAND NOT SUPPORT");
+}
+
+// SMS-DELIVER without SMSC, 7 bit default alphabet
+int SimModem::smsDeliver(char* pdu, size_t size, unsigned int index)
+{
+    char text[64];
+    char oa[32];
+    char ud[160];
+    snprintf(text, sizeof(text), "Hello from modemsim %u #%u", m_index, index);
+    snprintf(oa, sizeof(oa), "7900%07u", (m_index + 1) % 10000000);
+    char swapped[32];
+    swapDigits(oa, swapped);
+    pack7bit(text, ud);
+    time_t t = time(0);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char scts[32];
+    char stamp[32];
+    snprintf(stamp, sizeof(stamp), "%02d%02d%02d%02d%02d%02d00",
+	tm.tm_year % 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    swapDigits(stamp, scts);
+    return snprintf(pdu, size, "0004%02X91%s0000%s%02X%s",
+	(unsigned int)strlen(oa), swapped, scts, (unsigned int)strlen(text), ud);
+}
+
+void SimModem::smsBody(char* pdu)
+{
+    if (!*pdu)
+    {
+	reply("+CMS ERROR: 304");
+	return;
+    }
+    m_smsOut++;
+    replyf("+CMGS: %u\r\n\r\nOK", ++m_smsRef & 0xff);
+}
+
+void SimModem::timer(u_int64_t now)
+{
+    if (m_rssiAt && now >= m_rssiAt)
+    {
+	m_rssiLevel = 10 + (m_rssiLevel + 7) % 20;
+	replyf("^RSSI:%d", m_rssiLevel);
+	m_rssiAt = now + s_rssi;
+    }
+    if (m_connAt && now >= m_connAt)
+    {
+	m_connAt = 0;
+	reply("^CONF:1");
+	reply("^CONN:1,0");
+	m_call = CALL_ACTIVE;
+	m_callStart = now;
+	m_endAt = now + s_duration;
+    }
+    if (m_endAt && now >= m_endAt)
+	endCall(104, 16);
+    if (m_ringAt && now >= m_ringAt)
+    {
+	reply("RING");
+	replyf("+CLIP: \"+7901%07u\",145,,,,0", m_index);
+	m_ringAt = now + 3000;
+    }
+    if (m_missAt && now >= m_missAt)
+	endCall(104, 19);
+    if (m_cusdAt && now >= m_cusdAt)
+    {
+	char hex[256];
+	char text[64];
+	m_cusdAt = 0;
+	snprintf(text, sizeof(text), "Balance %u.00 RUB", 100 + m_index);
+	pack7bit(text, hex);
+	replyf("+CUSD: 0,\"%s\",15", hex);
+    }
+    if (!m_initialized)
+	return;
+    if (m_nextCall && now >= m_nextCall)
+    {
+	m_nextCall = now + s_incoming;
+	if (m_call == CALL_IDLE)
+	{
+	    m_calls++;
+	    m_call = CALL_ALERTING;
+	    m_callStart = 0;
+	    m_ringAt = now;
+	    m_missAt = now + 30000;
+	}
+    }
+    if (m_nextSms && now >= m_nextSms)
+    {
+	m_nextSms = now + s_sms;
+	if (m_smsStored >= SIM_SMS_STORAGE)
+	{
+	    reply("^SMMEMFULL:\"ME\"");
+	    return;
+	}
+	m_smsIn++;
+	m_smsStored++;
+	replyf("+CMTI: \"ME\",%u", m_smsIndex);
+	m_smsIndex = (m_smsIndex + 1) % SIM_SMS_STORAGE;
+    }
+}
+
+void SimModem::sendAudio(const short* tone, unsigned int frames)
+{
+    if (m_call != CALL_ACTIVE)
+	return;
+    for (unsigned int i = 0; i < frames; i++)
+    {
+	// Offset the tone per modem so captures can be told apart
+	const char* frame = (const char*)(tone + ((m_framesOut + m_index) % 8) * (SIM_FRAME_SIZE / 2));
+	if (write(m_audio, frame, SIM_FRAME_SIZE) != SIM_FRAME_SIZE)
+	{
+	    m_overruns++;
+	    break;
+	}
+	m_framesOut++;
+    }
+}
+
+void SimModem::dump() const
+{
+    static const char* calls[] = { "idle", "dialing", "alerting", "active" };
+    fprintf(stderr, "sim%u data=%s audio=%s init=%s call=%s cmds=%lu calls=%lu sms_in=%lu sms_out=%lu frames_out=%lu bytes_in=%lu overruns=%lu\n",
+	m_index, m_dataName, m_audioName, m_initialized ? "yes" : "no", calls[m_call],
+	m_commands, m_calls, m_smsIn, m_smsOut, m_framesOut, m_bytesIn, m_overruns);
+}
+
+static void sigHandler(int sig)
+{
+    if (sig == SIGUSR1)
+	s_dump = true;
+    else
+	s_running = false;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+	"Usage: %s [options]\n"
+	"  -n count    number of virtual modems (default 1, max %d)\n"
+	"  -d dir      create data<N>/audio<N> links to the ptys in dir\n"
+	"  -m model    model reported by AT+CGMM (default %s)\n"
+	"  -a msec     outgoing calls answered after (default %u)\n"
+	"  -t msec     active calls cleared by network after (default %u)\n"
+	"  -i msec     period of incoming calls per modem, 0 disables (default %u)\n"
+	"  -s msec     period of incoming SMS per modem, 0 disables (default %u)\n"
+	"  -r msec     period of ^RSSI reports (default %u)\n"
+	"Prints datacard.conf sections for the modems, SIGUSR1 dumps counters\n",
+	prog, SIM_MODEMS_MAX, s_model, s_answer, s_duration, s_incoming, s_sms, s_rssi);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int count = 1;
+    const char* dir = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:m:a:t:i:s:r:h")) != -1)
+    {
+	switch (opt)
+	{
+	    case 'n': count = atoi(optarg); break;
+	    case 'd': dir = optarg; break;
+	    case 'm': s_model = optarg; break;
+	    case 'a': s_answer = atoi(optarg); break;
+	    case 't': s_duration = atoi(optarg); break;
+	    case 'i': s_incoming = atoi(optarg); break;
+	    case 's': s_sms = atoi(optarg); break;
+	    case 'r': s_rssi = atoi(optarg); break;
+	    default:
+		usage(argv[0]);
+		return 1;
+	}
+    }
+    if (!count || count > SIM_MODEMS_MAX || !s_rssi)
+    {
+	usage(argv[0]);
+	return 1;
+    }
+    if (dir)
+	mkdir(dir, 0755);
+
+    signal(SIGINT, sigHandler);
+    signal(SIGTERM, sigHandler);
+    signal(SIGUSR1, sigHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    // 400 Hz tone, 8 frames make a whole number of periods
+    short tone[8 * SIM_FRAME_SIZE / 2];
+    for (unsigned int i = 0; i < sizeof(tone) / sizeof(tone[0]); i++)
+	tone[i] = (short)(8000 * sin(2 * M_PI * 400 * i / 8000));
+
+    SimModem* modems[SIM_MODEMS_MAX];
+    struct pollfd fds[SIM_MODEMS_MAX * 2];
+    for (unsigned int i = 0; i < count; i++)
+    {
+	modems[i] = new SimModem(i);
+	if (!modems[i]->open(dir))
+	{
+	    fprintf(stderr, "Cannot open ptys for modem %u: %s\n", i, strerror(errno));
+	    return 1;
+	}
+	fds[i * 2].fd = modems[i]->m_data;
+	fds[i * 2 + 1].fd = modems[i]->m_audio;
+	fds[i * 2].events = fds[i * 2 + 1].events = POLLIN;
+    }
+    fflush(stdout);
+
+    // Audio runs off an absolute 20 msec schedule so it does not drift
+    u_int64_t tick = msecNow() + SIM_FRAME_MSEC;
+    unsigned long ticks = 0;
+    unsigned long late = 0;
+    u_int64_t lateMax = 0;
+    while (s_running)
+    {
+	u_int64_t now = msecNow();
+	int wait = (tick > now) ? (int)(tick - now) : 0;
+	int n = poll(fds, count * 2, wait);
+	if (n < 0 && errno != EINTR)
+	    break;
+	for (unsigned int i = 0; n > 0 && i < count * 2; i++)
+	{
+	    if (!fds[i].revents)
+		continue;
+	    n--;
+	    if (i & 1)
+		modems[i / 2]->readAudio();
+	    else
+		modems[i / 2]->readData();
+	}
+	now = msecNow();
+	if (now >= tick)
+	{
+	    unsigned int frames = 1 + (now - tick) / SIM_FRAME_MSEC;
+	    if (now - tick > lateMax)
+		lateMax = now - tick;
+	    if (frames > 1)
+		late++;
+	    if (frames > SIM_CATCHUP_MAX)
+		frames = SIM_CATCHUP_MAX;
+	    for (unsigned int i = 0; i < count; i++)
+	    {
+		modems[i]->timer(now);
+		modems[i]->sendAudio(tone, frames);
+	    }
+	    ticks++;
+	    tick += (u_int64_t)frames * SIM_FRAME_MSEC;
+	    if (tick <= now)
+		tick = now + SIM_FRAME_MSEC;
+	}
+	if (s_dump)
+	{
+	    s_dump = false;
+	    for (unsigned int i = 0; i < count; i++)
+		modems[i]->dump();
+	    fprintf(stderr, "ticks=%lu late=%lu latemax=%llu ms\n", ticks, late, (unsigned long long)lateMax);
+	    fflush(stdout);
+	}
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+	modems[i]->dump();
+	delete modems[i];
+    }
+    fprintf(stderr, "ticks=%lu late=%lu latemax=%llu ms\n", ticks, late, (unsigned long long)lateMax);
+    return 0;
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */